@@ -0,0 +1,257 @@
+// ============================================================================
+//   Copyright 2023 Roland Metivier <metivier.roland@chlorophyt.us>
+//
+//   Licensed under the Apache License, Version 2.0 (the "License");
+//   you may not use this file except in compliance with the License.
+//   You may obtain a copy of the License at
+//
+//       http://www.apache.org/licenses/LICENSE-2.0
+//
+//   Unless required by applicable law or agreed to in writing, software
+//   distributed under the License is distributed on an "AS IS" BASIS,
+//   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+//   See the License for the specific language governing permissions and
+//   limitations under the License.
+// ============================================================================
+//   AxolotlSD for C++ microbenchmarks, one JSON object per line on stdout
+//
+//   Usage: axolotlsd_bench [name filter] [seconds per case]
+#include "../include/axolotlsd.hpp"
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <string>
+#include <string_view>
+
+using namespace axolotlsd;
+
+constexpr static U32 RATE = 44100;
+constexpr static U32 FRAMES_PER_CALL = 1024;
+
+static std::string_view filter = "";
+static F64 budget = 0.25;
+
+// Holds voices notes from the first tick to the last
+static std::vector<U8> held_notes(U32 voices, U32 ticks) {
+  return generate_song({.channels = 15,
+                        .voices = voices,
+                        .steps = 1,
+                        .step_ticks = ticks,
+                        .patch_size = 1024});
+}
+
+// Short chords on every melodic channel with the pitchwheel moving
+static std::vector<U8> busy_song(U32 notes) {
+  return generate_song({.channels = 8,
+                        .voices = 8,
+                        .steps = notes / 8,
+                        .step_ticks = 1,
+                        .pitchwheel = 1,
+                        .drums = 4,
+                        .patch_size = 4096,
+                        .ticks_per_second = 240});
+}
+
+template <typename F> static std::pair<U64, F64> run(F &&call) {
+  call();
+  auto calls = U64{0};
+  const auto start = std::chrono::steady_clock::now();
+  auto elapsed = 0.0;
+  do {
+    call();
+    calls++;
+    elapsed = std::chrono::duration<F64>(std::chrono::steady_clock::now() -
+                                         start)
+                  .count();
+  } while (elapsed < budget);
+  return {calls, elapsed * 1e9 / calls};
+}
+
+static bool wanted(std::string_view name) {
+  return name.find(filter) != std::string_view::npos;
+}
+
+static void report_frames(const std::string &name, U64 calls,
+                          F64 ns_per_call) {
+  const auto ns_per_frame = ns_per_call / FRAMES_PER_CALL;
+  const auto frames_per_second = 1e9 / ns_per_frame;
+  std::printf("{\"name\":\"%s\",\"frames\":%llu,\"ns_per_frame\":%.3f,"
+              "\"frames_per_second\":%.0f,\"realtime_factor\":%.2f}\n",
+              name.c_str(),
+              static_cast<unsigned long long>(calls * FRAMES_PER_CALL),
+              ns_per_frame, frames_per_second, frames_per_second / RATE);
+}
+
+// Every kernel set this CPU runs, oldest first, with its name
+static std::vector<std::pair<cpu_isa, const char *>> isas() {
+  auto found = std::vector<std::pair<cpu_isa, const char *>>{
+      {cpu_isa::baseline, "baseline"}};
+  if (detected_isa() >= cpu_isa::avx2) {
+    found.emplace_back(cpu_isa::avx2, "avx2");
+  }
+  if (detected_isa() >= cpu_isa::avx512) {
+    found.emplace_back(cpu_isa::avx512, "avx512");
+  }
+  return found;
+}
+
+static void bench_load() {
+  for (auto notes : {U32{1000}, U32{100000}}) {
+    const auto name = "song_load/notes=" + std::to_string(notes);
+    if (!wanted(name)) {
+      continue;
+    }
+    auto bytes = busy_song(notes);
+    const auto [calls, ns] = run([&bytes] { song::load(bytes); });
+    std::printf("{\"name\":\"%s\",\"iterations\":%llu,\"ns_per_load\":%.0f,"
+                "\"bytes_per_second\":%.0f}\n",
+                name.c_str(), static_cast<unsigned long long>(calls), ns,
+                bytes.size() * 1e9 / ns);
+  }
+  for (auto notes : {U32{1000}, U32{100000}}) {
+    const auto name = "song_load_lazy/notes=" + std::to_string(notes);
+    if (!wanted(name)) {
+      continue;
+    }
+    auto bytes = busy_song(notes);
+    const auto [calls, ns] =
+        run([&bytes] { song::load(bytes, {.mip_levels = 3, .lazy = true}); });
+    std::printf("{\"name\":\"%s\",\"iterations\":%llu,\"ns_per_load\":%.0f,"
+                "\"bytes_per_second\":%.0f}\n",
+                name.c_str(), static_cast<unsigned long long>(calls), ns,
+                bytes.size() * 1e9 / ns);
+  }
+  for (auto notes : {U32{1000}, U32{100000}}) {
+    const auto name = "song_validate/notes=" + std::to_string(notes);
+    if (!wanted(name)) {
+      continue;
+    }
+    auto bytes = busy_song(notes);
+    const auto [calls, ns] = run([&bytes] { song::validate(bytes); });
+    std::printf("{\"name\":\"%s\",\"iterations\":%llu,\"ns_per_load\":%.0f,"
+                "\"bytes_per_second\":%.0f}\n",
+                name.c_str(), static_cast<unsigned long long>(calls), ns,
+                bytes.size() * 1e9 / ns);
+  }
+  for (auto notes : {U32{1000}, U32{100000}}) {
+    const auto name = "song_load_compiled/notes=" + std::to_string(notes);
+    if (!wanted(name)) {
+      continue;
+    }
+    auto bytes = busy_song(notes);
+    const auto hash = source_hash(bytes);
+    const auto image = song::load(bytes).compile(hash);
+    const auto [calls, ns] =
+        run([&image, hash] { song::load_compiled(image, hash); });
+    std::printf("{\"name\":\"%s\",\"iterations\":%llu,\"ns_per_load\":%.0f,"
+                "\"bytes_per_second\":%.0f}\n",
+                name.c_str(), static_cast<unsigned long long>(calls), ns,
+                image.size() * 1e9 / ns);
+  }
+}
+
+static void bench_tick() {
+  const auto started = active_isa();
+  const auto qualities = {std::pair{interpolation::none, "none"},
+                          std::pair{interpolation::linear, "linear"},
+                          std::pair{interpolation::cubic, "cubic"},
+                          std::pair{interpolation::sinc, "sinc"}};
+  for (auto voices : {U32{1}, U32{8}, U32{32}, U32{128}}) {
+    for (auto &&[quality, label] : qualities) {
+      for (auto &&[isa, isa_label] : isas()) {
+        const auto name = "player_tick/voices=" + std::to_string(voices) +
+                          "/quality=" + label + "/isa=" + isa_label;
+        if (!wanted(name)) {
+          continue;
+        }
+        force_isa(isa);
+        auto bytes = held_notes(voices, 1 << 20);
+        auto p = std::make_unique<player>(voices, RATE, true);
+        p->load(song::load(bytes));
+        p->quality = quality;
+        p->play();
+        auto out = std::vector<F32>(FRAMES_PER_CALL * 2);
+        const auto [calls, ns] = run([&p, &out] { p->tick(out); });
+        report_frames(name, calls, ns);
+      }
+    }
+  }
+  force_isa(started);
+}
+
+// With no song playing a tick is just the block stages, so echo and sfx
+// costs show up on their own
+static void bench_echo() {
+  const auto started = active_isa();
+  for (auto fir : {false, true}) {
+    for (auto &&[isa, isa_label] : isas()) {
+      const auto name = std::string{"echo/fir="} + (fir ? "on" : "off") +
+                        "/isa=" + isa_label;
+      if (!wanted(name)) {
+        continue;
+      }
+      force_isa(isa);
+      auto env = environment{.feedback_L = 0.5f,
+                             .feedback_R = 0.5f,
+                             .wet_L = 0.3f,
+                             .wet_R = 0.3f,
+                             .cursor_max = 8000};
+      if (fir) {
+        env.fir_filter = environment::parse_sfc_echo(
+            {0x7F, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00});
+      }
+      auto p = std::make_unique<player>(1, RATE, true);
+      p->put_environment(env);
+      auto out = std::vector<F32>(FRAMES_PER_CALL * 2);
+      const auto [calls, ns] = run([&p, &out] { p->tick(out); });
+      report_frames(name, calls, ns);
+    }
+  }
+  force_isa(started);
+}
+
+static void bench_sfx() {
+  for (auto count : {U32{1}, U32{16}, U32{64}}) {
+    const auto name = "sfx/sounds=" + std::to_string(count);
+    if (!wanted(name)) {
+      continue;
+    }
+    auto p = std::make_unique<player>(1, RATE, true);
+    auto data = std::vector<U8>(1 << 16);
+    auto state = U32{0x9E3779B9};
+    for (auto &&b : data) {
+      state ^= state << 13;
+      state ^= state >> 17;
+      state ^= state << 5;
+      b = static_cast<U8>(state);
+    }
+    for (auto i = U32{0}; i < count; i++) {
+      p->queue_sfx(sfx{.pitch = 1.0f + (i * 0.01f), .data = data});
+    }
+    auto out = std::vector<F32>(FRAMES_PER_CALL * 2);
+    const auto [calls, ns] = run([&p, &out] {
+      // rewound rather than requeued so every call mixes count sounds
+      for (auto &&s : p->current_sfx) {
+        if (s.finished()) {
+          s.position = 0;
+        }
+      }
+      p->tick(out);
+    });
+    report_frames(name, calls, ns);
+  }
+}
+
+int main(int argc, char **argv) {
+  if (argc > 1) {
+    filter = argv[1];
+  }
+  if (argc > 2) {
+    budget = std::strtod(argv[2], nullptr);
+  }
+  bench_load();
+  bench_tick();
+  bench_echo();
+  bench_sfx();
+  return EXIT_SUCCESS;
+}
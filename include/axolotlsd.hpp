@@ -17,11 +17,25 @@
 #pragma once
 #include "axolotlsd_configuration.hpp"
 #include <array>
+#include <atomic>
+#include <chrono>
+#include <compare>
+#include <condition_variable>
 #include <cstdint>
-#include <list>
+#include <deque>
+#include <future>
 #include <map>
 #include <memory>
+#include <mutex>
+#include <new>
 #include <optional>
+#include <span>
+#include <string>
+#include <string_view>
+#include <thread>
+#include <type_traits>
+#include <unordered_map>
+#include <variant>
 #include <vector>
 
 namespace axolotlsd {
@@ -38,9 +52,75 @@ using S64 = std::int64_t;
 using F32 = float;
 using F64 = double;
 
+// Signed Q15.16 sample for targets without fast floating point, products and
+// quotients go through 64 bits
+struct fixed_t {
+  static constexpr S32 ONE = 1 << 16;
+  S32 raw = 0;
+
+  constexpr fixed_t() = default;
+  template <typename N>
+    requires std::is_arithmetic_v<N>
+  constexpr explicit fixed_t(N x) {
+    if constexpr (std::is_integral_v<N>) {
+      raw = static_cast<S32>(x) * ONE;
+    } else {
+      raw = static_cast<S32>((x * ONE) + ((x < 0) ? -0.5 : 0.5));
+    }
+  }
+  template <typename N>
+    requires std::is_floating_point_v<N>
+  constexpr explicit operator N() const {
+    return static_cast<N>(raw) / ONE;
+  }
+  static constexpr fixed_t from_raw(S32 r) {
+    auto f = fixed_t{};
+    f.raw = r;
+    return f;
+  }
+
+  constexpr fixed_t operator-() const { return from_raw(-raw); }
+  friend constexpr fixed_t operator+(fixed_t a, fixed_t b) {
+    return from_raw(a.raw + b.raw);
+  }
+  friend constexpr fixed_t operator-(fixed_t a, fixed_t b) {
+    return from_raw(a.raw - b.raw);
+  }
+  friend constexpr fixed_t operator*(fixed_t a, fixed_t b) {
+    return from_raw(static_cast<S32>((S64{a.raw} * b.raw) >> 16));
+  }
+  friend constexpr fixed_t operator/(fixed_t a, fixed_t b) {
+    return from_raw(static_cast<S32>((S64{a.raw} << 16) / b.raw));
+  }
+  constexpr fixed_t &operator+=(fixed_t b) { return *this = *this + b; }
+  constexpr fixed_t &operator-=(fixed_t b) { return *this = *this - b; }
+  constexpr fixed_t &operator*=(fixed_t b) { return *this = *this * b; }
+  friend constexpr auto operator<=>(const fixed_t &,
+                                    const fixed_t &) = default;
+};
+
+// Sample type of the default player, see basic_player
 using audio_data_t = F32;
 using song_tick_t = U32;
 using patch_data_t = std::vector<U8>;
+
+enum class channel_layout : U8 { mono = 1, stereo = 2 };
+template <channel_layout L, typename T = F32>
+using frame_t = std::array<T, static_cast<std::size_t>(L)>;
+
+// Wavetable read quality, cheapest first
+enum class interpolation : U8 { none, linear, cubic, sinc };
+
+// Instruction sets the render kernels are built for, oldest first
+enum class cpu_isa : U8 { baseline, avx2, avx512 };
+// The best set this CPU runs
+cpu_isa detected_isa();
+// The set every player renders with, picked once from detected_isa() unless
+// AXOLOTLSD_ISA (baseline, avx2 or avx512) asks for an older one
+cpu_isa active_isa();
+// Switches every player over, returns the set actually used since nothing
+// newer than detected_isa() is ever run
+cpu_isa force_isa(cpu_isa);
 // ============================================================================
 enum class command_type : U8 {
   // regular
@@ -56,98 +136,378 @@ enum class command_type : U8 {
   rate = 0xFD,
   end_of_track = 0xFE,
 };
-struct command {
-  virtual command_type get_type() = 0;
-};
-struct command_note_on : command {
-  virtual command_type get_type() { return command_type::note_on; }
+struct command_note_on {
+  static constexpr command_type type = command_type::note_on;
   U8 channel;
   U8 note;
   U8 velocity;
 };
-struct command_note_off : command {
-  virtual command_type get_type() { return command_type::note_off; }
+struct command_note_off {
+  static constexpr command_type type = command_type::note_off;
   U8 channel;
 };
-struct command_pitchwheel : command {
-  virtual command_type get_type() { return command_type::pitchwheel; }
+struct command_pitchwheel {
+  static constexpr command_type type = command_type::pitchwheel;
   U8 channel;
   S32 bend;
 };
-struct command_program_change : command {
-  virtual command_type get_type() { return command_type::program_change; }
+struct command_program_change {
+  static constexpr command_type type = command_type::program_change;
   U8 channel;
   U8 program;
 };
-struct command_patch_data : command {
-  virtual command_type get_type() { return command_type::patch_data; }
+struct command_patch_data {
+  static constexpr command_type type = command_type::patch_data;
 };
-struct command_drum_data : command {
-  virtual command_type get_type() { return command_type::drum_data; }
+struct command_drum_data {
+  static constexpr command_type type = command_type::drum_data;
 };
-struct command_version : command {
-  virtual command_type get_type() { return command_type::version; }
+struct command_version {
+  static constexpr command_type type = command_type::version;
   U16 song_version;
 };
-struct command_rate : command {
-  virtual command_type get_type() { return command_type::rate; }
+struct command_rate {
+  static constexpr command_type type = command_type::rate;
   U32 song_rate;
 };
-struct command_end_of_track : command {
-  virtual command_type get_type() { return command_type::end_of_track; }
+struct command_end_of_track {
+  static constexpr command_type type = command_type::end_of_track;
 };
+// Commands are plain data, the variant index stands in for the type tag
+using command = std::variant<command_note_on, command_note_off,
+                             command_pitchwheel, command_program_change,
+                             command_patch_data, command_drum_data,
+                             command_version, command_rate,
+                             command_end_of_track>;
+inline command_type type_of(const command &c) {
+  return std::visit([](auto &&held) { return held.type; }, c);
+}
 // ============================================================================
+// Linear ADSR, times are in seconds, release counts from full scale
+struct envelope_t {
+  F32 attack = 0.0f;
+  F32 decay = 0.0f;
+  F32 sustain = 1.0f;
+  F32 release = 0.0f;
+};
+enum class envelope_stage : U8 { attack, decay, sustain, release };
+// Sample bytes, never changed once loaded. They are either owned or borrowed
+// from storage that outlives every song playing them, like an embedded table.
+struct waveform_t {
+  using value_type = U8;
+  std::span<const U8> bytes{};
+  std::shared_ptr<const void> owner{};
+
+  static waveform_t own(patch_data_t &&data) {
+    auto held = std::make_shared<const patch_data_t>(std::move(data));
+    return {*held, held};
+  }
+  static waveform_t borrow(std::span<const U8> from) { return {from}; }
+
+  const U8 *data() const { return bytes.data(); }
+  std::size_t size() const { return bytes.size(); }
+  auto begin() const { return bytes.begin(); }
+  auto end() const { return bytes.end(); }
+  U8 operator[](std::size_t i) const { return bytes[i]; }
+};
 struct patch_base_t {
-  virtual bool is_drum() = 0;
-  patch_data_t waveform{};
+  waveform_t waveform{};
   F32 ratio;
   F32 gain_L;
   F32 gain_R;
+  // without an envelope a voice plays at full level until its sample ends
+  std::optional<envelope_t> envelope = std::nullopt;
+};
+// Mip levels song::load leaves for later under load_options::lazy, built at
+// most once however many players or threads ask for them
+struct pending_mips {
+  U8 count;
+  std::once_flag once{};
+  std::atomic<bool> ready = false;
+  // set once a player has handed them to the prefetcher
+  std::atomic<bool> queued = false;
+  std::vector<std::vector<F32>> levels{};
 };
 struct patch_t : patch_base_t {
   U32 loop_start;
   U32 loop_end;
+  // band-limited copies of the waveform, one octave apart, level 0 (the
+  // waveform itself) is not stored here
+  std::vector<std::vector<F32>> mip_levels{};
+  std::shared_ptr<pending_mips> pending = nullptr;
 
-  virtual bool is_drum() { return false; }
-};
-struct drum_t : patch_base_t {
-  virtual bool is_drum() { return true; }
+  // Builds pending mip levels, cheap once done. Until then mips() is empty
+  // and the patch renders from its waveform alone. Waits while another
+  // thread builds them, so players leave this to the prefetcher.
+  void materialize() const;
+  bool materialized() const {
+    return !pending || pending->ready.load(std::memory_order_acquire);
+  }
+  const std::vector<std::vector<F32>> &mips() const {
+    if (pending && pending->ready.load(std::memory_order_acquire)) {
+      return pending->levels;
+    }
+    return mip_levels;
+  }
 };
+struct drum_t : patch_base_t {};
 using drum_map_t = std::map<U8, drum_t>;
 // ============================================================================
-struct voice_single {
-  F32 velocity;
-  F32 phase_add_by;
-  U8 note;
-  F32 phase = 0.0f;
-  bool key = true;
-  bool active = true;
+// Hands out cache line aligned storage for the voice columns
+template <typename T> struct aligned_allocator {
+  using value_type = T;
+  static constexpr std::align_val_t ALIGNMENT{64};
+
+  aligned_allocator() = default;
+  template <typename U> aligned_allocator(const aligned_allocator<U> &) {}
+
+  T *allocate(std::size_t n) {
+    return static_cast<T *>(::operator new(n * sizeof(T), ALIGNMENT));
+  }
+  void deallocate(T *p, std::size_t) { ::operator delete(p, ALIGNMENT); }
+  bool operator==(const aligned_allocator &) const { return true; }
+};
+// What the voice kernels need to know about the player rendering them
+struct render_params {
+  F32 frequency;
+  // voices whose loudest gain stays under this are advanced but not mixed
+  F32 cull_below;
 };
-struct voice_group_base {
-  std::vector<voice_single> voices{};
-  virtual bool is_drum_kit() = 0;
+// Every voice of a player, stored column by column in note-on order
+struct voice_pool {
+  static constexpr U8 KEY = 0x01;
+  static constexpr U8 ACTIVE = 0x02;
+  template <typename T> using column = std::vector<T, aligned_allocator<T>>;
+
+  column<F32> phase{};
+  column<F32> phase_add_by{};
+  column<F32> velocity{};
+  column<F32> level{};
+  column<U8> note{};
+  column<U8> channel{};
+  column<envelope_stage> stage{};
+  column<U8> flags{};
+  std::array<U32, 16> per_channel{0};
+
+  std::size_t size() const { return phase.size(); }
+  bool keyed(std::size_t v) const { return (flags[v] & KEY) != 0; }
+  void reserve(std::size_t);
+  void clear();
+  void add(U8, U8, F32, F32);
+  void compact();
+
+  template <channel_layout L, interpolation I, typename T>
+  bool accumulate_patch(std::size_t, const patch_t &, T *, U32,
+                        const render_params &);
+  template <channel_layout L, interpolation I, typename T>
+  bool accumulate_drum(std::size_t, const drum_t &, T *, U32,
+                       const render_params &);
 };
-struct voice_group : voice_group_base {
+struct voice_group {
   F32 bend = 0.0f;
-  void accumulate_into(const patch_t &, F32 &, F32 &);
-  virtual bool is_drum_kit() { return false; }
-};
-struct drum_group : voice_group_base {
-  void accumulate_into(const drum_map_t &, F32 &, F32 &);
-  virtual bool is_drum_kit() { return true; }
+  // the pitchwheel as read from the song, 4096 steps per semitone
+  S32 wheel = 0;
 };
+struct drum_group {};
+// Channel kinds are resolved by type, never through a vtable or the heap
+using channel_t = std::variant<voice_group, drum_group>;
 // ============================================================================
+struct load_options {
+  // build this many band-limited octaves for each looping patch, 0 skips it
+  U8 mip_levels = 0;
+  // Keeps one copy of the source and points every waveform into it rather
+  // than copying each out, and puts mip levels off until a player first
+  // needs a patch, when the prefetcher builds them (see patch_t::materialize).
+  // That copy is the whole source, so until the mips are built this holds
+  // about as much as an eager load, only the mip building is deferred.
+  // Renders use level 0 until a patch is built, so output depends on the
+  // prefetcher's timing. Deterministic players build every patch in play()
+  // and queue_song() instead.
+  bool lazy = false;
+  // takes waveforms from waveform_store::global(), so songs sharing samples
+  // hold them once, this wins over lazy for the waveforms themselves
+  bool intern = false;
+};
+// How song::load_compiled checks an image and whether it copies out of it
+struct compiled_options {
+  // the source_hash() of the AXSD the image must have been compiled from
+  std::optional<U64> source_hash = std::nullopt;
+  // Keeps the image alive, waveforms then point into it rather than being
+  // copied. Mip levels are always copied.
+  std::shared_ptr<const void> storage = nullptr;
+  // the caller already checked this image's checksum, bounds are still
+  // checked
+  bool checked = false;
+};
+// A song already split into flat tables, see axolotlsd_embed.hpp. Waveforms
+// are slices of one pool and drums leave the loop points unused.
+struct table_patch {
+  U8 id;
+  U32 loop_start;
+  U32 loop_end;
+  F32 ratio;
+  F32 gain_L;
+  F32 gain_R;
+  U32 waveform_at;
+  U32 waveform_size;
+};
+struct song_tables {
+  U16 version;
+  song_tick_t ticks_end;
+  song_tick_t ticks_per_second;
+  std::span<const std::pair<song_tick_t, command>> commands;
+  std::span<const table_patch> patches;
+  std::span<const table_patch> drums;
+  std::span<const U8> waveforms;
+};
+enum class load_error_kind : U8 {
+  // the first 4 bytes are not "AXSD"
+  bad_magic,
+  // a command type song::load has no size for
+  unknown_command,
+  // a command or its waveform runs past the end
+  truncated,
+  // song_loader only, see song_loader::ticket::cancel
+  cancelled,
+};
+struct load_error {
+  load_error_kind kind;
+  // where the failing command's type byte is
+  std::size_t offset;
+
+  const char *what() const;
+};
+// A loaded V or the reason there is none, in the shape of C++23's
+// std::expected. Only dereference it when has_value().
+template <typename V> struct load_result {
+  std::variant<V, load_error> held;
+
+  bool has_value() const { return held.index() == 0; }
+  explicit operator bool() const { return has_value(); }
+  V &operator*() { return *std::get_if<0>(&held); }
+  const V &operator*() const { return *std::get_if<0>(&held); }
+  V *operator->() { return std::get_if<0>(&held); }
+  const V *operator->() const { return std::get_if<0>(&held); }
+  const load_error &error() const { return *std::get_if<1>(&held); }
+};
 struct song {
   U16 version;
   song_tick_t ticks_end;
   song_tick_t ticks_per_second;
 
-  std::multimap<song_tick_t, std::unique_ptr<command>> commands{};
+  // sorted by tick, commands sharing a tick stay in file order
+  std::vector<std::pair<song_tick_t, command>> commands{};
   std::map<U8, patch_t> patches{};
   drum_map_t drums{};
 
-  static song load(std::vector<U8> &);
+  // Throws std::runtime_error on a bad magic and std::out_of_range on any
+  // other load_error
+  static song load(std::vector<U8> &, const load_options & = {});
+  // The same parser without exceptions
+  static load_result<song> try_load(std::span<const U8>,
+                                    const load_options & = {});
+  // Checks a buffer as try_load() would without building anything
+  static std::optional<load_error> validate(std::span<const U8>);
+  // Canonical AXSD: header, patches and drums by id, then commands by tick.
+  // Envelopes and mip levels are not part of the format and are dropped.
+  std::vector<U8> save() const;
+  // A ready-to-play image of this song, mip levels and envelopes included,
+  // stamped with the source_hash() of the AXSD it came from
+  std::vector<U8> compile(U64) const;
+  // Loads an image with copies only, checking its checksum and, when given,
+  // that it was compiled from AXSD with this source_hash()
+  static song load_compiled(std::span<const U8>,
+                            std::optional<U64> = std::nullopt);
+  static song load_compiled(std::span<const U8>, const compiled_options &);
+  // Builds a song straight from tables without parsing anything, waveforms
+  // are borrowed so the pool must outlive the song
+  static song load_tables(const song_tables &, const load_options & = {});
+};
+// Identifies an AXSD byte stream for compiled images
+U64 source_hash(std::span<const U8>);
+// Holds one copy of every distinct interned waveform, keyed by content. A
+// waveform is freed with the last song using it, the store only keeps a
+// weak reference.
+struct waveform_store {
+  struct stats_t {
+    // distinct waveforms still in use and the bytes they take up
+    U64 waveforms;
+    U64 bytes;
+    // intern() calls answered with a waveform already held
+    U64 hits;
+    // what the songs using these waveforms would take up on top, were each
+    // holder its own copy
+    U64 bytes_saved;
+  };
+
+  std::mutex lock{};
+  std::unordered_multimap<U64, std::weak_ptr<const patch_data_t>> entries{};
+  U64 hits = 0;
+
+  // the store load_options::intern uses
+  static waveform_store &global();
+  waveform_t intern(std::span<const U8>);
+  stats_t stats();
+  // forgets waveforms no song uses any more, returns how many
+  std::size_t purge();
+};
+// Parses songs on background threads, oldest request first. Finished songs
+// come back through a future, ready for basic_player::queue_song().
+struct song_loader {
+  using result_t = load_result<std::shared_ptr<const song>>;
+  struct request {
+    std::vector<U8> bytes;
+    load_options options;
+    std::promise<result_t> promise{};
+    std::atomic<bool> cancelled = false;
+  };
+  struct ticket {
+    std::shared_ptr<request> held;
+    std::future<result_t> result;
+
+    // A request not yet started is never parsed, one already parsing is
+    // dropped when it ends. Either way the result is a cancelled error.
+    void cancel() { held->cancelled = true; }
+    bool ready() const {
+      return result.wait_for(std::chrono::seconds{0}) ==
+             std::future_status::ready;
+    }
+  };
+
+  explicit song_loader(U32 = 1);
+  ~song_loader();
+
+  ticket load(std::vector<U8>, const load_options & = {});
+
+  std::vector<std::thread> workers{};
+  std::mutex lock{};
+  std::condition_variable wake{};
+  std::deque<std::shared_ptr<request>> queue{};
+  bool stopping = false;
+
+  void work();
+};
+// The shape of a synthetic song, for stress and scaling tests
+struct generator_options {
+  U32 seed = 1;
+  // melodic channels in use, channel 9 is skipped since it plays drums
+  U8 channels = 8;
+  // notes held at once, spread over the channels and all changed together
+  // every step
+  U32 voices = 8;
+  U32 steps = 64;
+  U32 step_ticks = 4;
+  // pitchwheel events per channel per step, 0 leaves pitch alone
+  U32 pitchwheel = 0;
+  // hits on channel 9 every step, each drum note gets its own sample
+  U8 drums = 0;
+  U32 patch_size = 4096;
+  bool looping = true;
+  U32 ticks_per_second = 60;
 };
+// Writes an AXSD v3 byte stream song::load accepts, the same options always
+// give the same bytes
+std::vector<U8> generate_song(const generator_options &);
 struct environment {
   F32 feedback_L;
   F32 feedback_R;
@@ -163,46 +523,220 @@ struct sfx {
   F32 pan_R = 1.0f;
   F32 pitch = 1.0f;
   F32 accumulator = 0.0f;
-  std::list<U8> data{};
+  std::vector<U8> data{};
+  U32 position = 0;
+
+  bool finished() const { return position >= data.size(); }
 
   static sfx load_xxd_format(unsigned char *, unsigned int);
 };
-struct player {
+// ============================================================================
+// Many songs and sound effects packed into one archive. Opening one maps it
+// and reads only the header, names are found through a hash table stored in
+// the archive and entries are decoded when asked for.
+enum class entry_kind : U8 { song, compiled, sfx };
+struct library_input {
+  std::string name;
+  // AXSD, a compiled image or raw sfx samples, told apart by magic
+  std::vector<U8> bytes;
+  bool compress = false;
+};
+struct library {
+  struct entry {
+    std::string_view name;
+    entry_kind kind;
+    bool compressed;
+    U64 size;
+  };
+
+  // Keeps a mapped or read in archive alive for as long as any copy, and
+  // any song whose waveforms point into it
+  std::shared_ptr<const void> storage = nullptr;
+  std::span<const U8> archive{};
+  // one flag per entry, set once its compiled image passed its checksum
+  std::shared_ptr<std::vector<std::atomic<bool>>> checked = nullptr;
+
+  static library open(const std::string &);
+  // the bytes must outlive the library, e.g. an archive compiled in
+  static library view(std::span<const U8>);
+  // entry names must be unique
+  static std::vector<U8> pack(std::span<const library_input>);
+
+  U32 size() const;
+  std::optional<U32> find(std::string_view) const;
+  entry info(U32) const;
+  // the entry's bytes, uncompressed and checked against their hash
+  std::vector<U8> read(U32) const;
+  // Compiled entries in an opened library keep their waveforms in the
+  // archive and are checksummed on their first load only
+  song load_song(U32, const load_options & = {}) const;
+  sfx load_sfx(U32) const;
+};
+// ============================================================================
+// Materializes patches for every player in the process on one thread.
+// Players hand it the ticks they are about to play and any patch they find
+// unbuilt, and render from the waveform alone until it is done.
+struct prefetcher {
+  static constexpr std::size_t MAX_JOBS = 256;
+  struct job {
+    std::shared_ptr<const song> target = nullptr;
+    // one patch, or when null every patch picked in [from, until)
+    const patch_t *patch = nullptr;
+    song_tick_t from = 0;
+    song_tick_t until = 0;
+  };
+
+  std::mutex lock{};
+  std::condition_variable wake{};
+  std::array<job, MAX_JOBS> jobs{};
+  std::size_t head = 0;
+  std::size_t queued = 0;
+  bool stopping = false;
+  std::thread worker;
+
+  prefetcher();
+  ~prefetcher();
+
+  // Started by the first lazy load, so the audio thread never starts it
+  static prefetcher &shared();
+  // Never block or allocate, false while the worker holds the lock or the
+  // queue is full so try again later
+  bool request(const std::shared_ptr<const song> &, song_tick_t, song_tick_t);
+  bool request(const std::shared_ptr<const song> &, const patch_t &);
+  bool push(job &&);
+  void work();
+};
+// ============================================================================
+// Plays one song, mixing in samples of type T: F32 for production, F64 as a
+// reference and fixed_t where floating point is slow. Control values (time,
+// pitch, envelopes, volume) stay F32 whatever T is.
+template <typename T> struct basic_player {
+  static constexpr U32 BLOCK_FRAMES = 64;
+
   F32 seconds_elapsed = 0.0f;
   F32 seconds_end;
   F32 frequency;
+  U32 sample_rate;
   U32 max_voices;
   U32 on_voices = 0;
+  // Voices skipped as inaudible during the last tick(), once per event-free
+  // run they sat out, so a voice culled for a whole call counts several times
+  U32 culled_voices = 0;
+  F32 cull_threshold = 1.0f / 65536.0f;
   F32 master_volume = 1.0f;
+  interpolation quality = interpolation::none;
+  // Renders bit-identically on every platform and instruction set: pitch
+  // comes from compile time tables and song time counts whole frames.
+  // Lazily loaded songs are built in full by play() and queue_song().
+  // Takes effect on play().
+  bool deterministic = false;
+  U64 frames_elapsed = 0;
+  U64 frames_end = 0;
 
-  F32 echo_buffer_L[65535]{0.0f};
-  F32 echo_buffer_R[65535]{0.0f};
+  T echo_buffer_L[65535]{};
+  T echo_buffer_R[65535]{};
   U16 echo_cursor = 0;
+  std::array<T, BLOCK_FRAMES * 2> mix_buffer{};
   std::optional<environment> env_params = std::nullopt;
 
   U32 cursor = 0;
   std::optional<U32> last_cursor = std::nullopt;
+  // With lazily loaded songs, patches picked up to this many ticks past the
+  // cursor are materialized ahead of time, 0 waits until a voice needs one.
+  // Takes effect on play().
+  U32 prefetch_ticks = 0;
+  prefetcher *prefetch = nullptr;
+  U32 prefetched_until = 0;
 
-  song current;
+  // songs are immutable once loaded, so many players can share one
+  std::shared_ptr<const song> current = nullptr;
   bool in_stereo;
+  // where queue_song() leaves the next song for the audio thread
+  std::mutex handover_lock{};
+  std::shared_ptr<const song> handover = nullptr;
+  bool handover_waiting = false;
 
-  explicit player(U32, U32, bool);
+  explicit basic_player(U32, U32, bool);
 
-  std::array<std::unique_ptr<voice_group_base>, 16> channels{};
+  std::array<channel_t, 16> channels{};
   std::array<std::optional<U8>, 16> patch_ids{std::nullopt};
+  voice_pool voices{};
   std::vector<sfx> current_sfx{};
 
   bool playback = false;
+  U32 dither_state = 0x9E3779B9;
 
   void put_environment(std::optional<environment> &&);
   sfx &queue_sfx(sfx &&);
   void load(song &&);
-  void load_xxd_format(unsigned char *, unsigned int);
+  void load(std::shared_ptr<const song>);
+  // parses at runtime, songs known at build time can use load_embedded()
+  void load_xxd_format(unsigned char *, unsigned int,
+                       const load_options & = {});
 	void play();
+  // Starts this song from its first tick at the next block boundary, safe
+  // to call while another thread renders. The audio thread only ever tries
+  // the lock, so it never waits here. Call play() once beforehand so the
+  // voices are reserved.
+  void queue_song(std::shared_ptr<const song>);
+  void take_handover();
+  void rewind();
   void pause();
   void tick(std::vector<F32> &);
-  void handle_one(F32 &, F32 &);
-  void handle_sfx(F32 &, F32 &);
-  void maybe_echo_one(F32 &, F32 &);
+  void tick(std::span<F32>);
+  void tick(std::span<S16>, bool = false);
+  void tick(std::span<F32>, std::span<F32>);
+  template <channel_layout L> void render_block(U32);
+  void handle_events();
+  void request_prefetch();
+  void hand_to_prefetcher(const patch_t &);
+  U32 advance(U32);
+  template <channel_layout L> void accumulate_voices(T *, U32);
+  template <channel_layout L> void handle_sfx(U32);
+  template <channel_layout L> void maybe_echo(U32);
+};
+extern template struct basic_player<F32>;
+extern template struct basic_player<F64>;
+extern template struct basic_player<fixed_t>;
+using player = basic_player<audio_data_t>;
+// ============================================================================
+// Renders one block of many independent players across a work-stealing pool.
+// Each player keeps a home worker so its state stays warm in that core's
+// cache, idle workers steal from the back of the others' queues.
+struct player_pool {
+  struct worker_queue {
+    std::mutex lock{};
+    std::vector<U32> home{};
+    std::vector<U32> jobs{};
+    std::size_t head = 0;
+  };
+  struct block_report {
+    F64 wall_seconds;
+    U32 stolen;
+  };
+
+  U32 frames;
+  std::vector<player *> players{};
+  // a deque so buffers handed out by add() stay put as more are added
+  std::deque<std::vector<F32>> outputs{};
+
+  explicit player_pool(U32, U32 = std::thread::hardware_concurrency());
+  ~player_pool();
+
+  std::vector<F32> &add(player &);
+  block_report render();
+
+  std::vector<std::thread> workers{};
+  std::vector<std::unique_ptr<worker_queue>> queues{};
+  std::mutex state_lock{};
+  std::condition_variable block_start{};
+  std::condition_variable block_done{};
+  U64 generation = 0;
+  std::size_t remaining = 0;
+  std::atomic<U32> stolen{0};
+  bool stopping = false;
+
+  void work(U32);
+  bool run_one(U32);
 };
 } // namespace axolotlsd
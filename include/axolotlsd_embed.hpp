@@ -0,0 +1,266 @@
+// ============================================================================
+//   Copyright 2023 Roland Metivier <metivier.roland@chlorophyt.us>
+//
+//   Licensed under the Apache License, Version 2.0 (the "License");
+//   you may not use this file except in compliance with the License.
+//   You may obtain a copy of the License at
+//
+//       http://www.apache.org/licenses/LICENSE-2.0
+//
+//   Unless required by applicable law or agreed to in writing, software
+//   distributed under the License is distributed on an "AS IS" BASIS,
+//   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+//   See the License for the specific language governing permissions and
+//   limitations under the License.
+// ============================================================================
+//   AxolotlSD for C++ compile time song embedding
+//
+//   A song kept in a constexpr byte array (a std::array, or an "xxd -i" dump
+//   with constexpr added) is decoded while compiling:
+//
+//     static constexpr unsigned char title_axsd[] = {0x41, 0x58, ...};
+//     p.load(axolotlsd::load_embedded<title_axsd>());
+//
+//   A bad song fails the build, nothing here throws so it also works with
+//   exceptions turned off. Large waveforms may need the compiler's constexpr
+//   loop and operation limits raised.
+#pragma once
+#include "axolotlsd.hpp"
+#include <bit>
+#include <cstdio>
+#include <cstdlib>
+#include <iterator>
+
+namespace axolotlsd {
+namespace embed_detail {
+// Not constexpr, so reaching it while decoding is a compile error that
+// names the problem
+[[noreturn]] inline void invalid_song(const char *what) {
+  std::fputs(what, stderr);
+  std::abort();
+}
+
+// Bytes after the type byte, as song::load reads them
+constexpr std::size_t payload_size(U8 type) {
+  switch (static_cast<command_type>(type)) {
+  case command_type::note_on:
+    return sizeof(song_tick_t) + 3;
+  case command_type::note_off:
+    return sizeof(song_tick_t) + 1;
+  case command_type::pitchwheel:
+    return sizeof(song_tick_t) + 1 + sizeof(U32);
+  case command_type::program_change:
+    return sizeof(song_tick_t) + 2;
+  case command_type::patch_data:
+    return 1 + (sizeof(U32) * 3) + (sizeof(F32) * 3);
+  case command_type::drum_data:
+    return 1 + sizeof(U32) + (sizeof(F32) * 3);
+  case command_type::version:
+    return sizeof(U16);
+  case command_type::rate:
+    return sizeof(U32);
+  case command_type::end_of_track:
+    return sizeof(song_tick_t);
+  }
+  invalid_song("This song has an unknown command!");
+  return 0;
+}
+
+template <typename B> constexpr U32 read_u32(const B &bytes, std::size_t at) {
+  return (U32{static_cast<U8>(bytes[at + 0])} << 0) |
+         (U32{static_cast<U8>(bytes[at + 1])} << 8) |
+         (U32{static_cast<U8>(bytes[at + 2])} << 16) |
+         (U32{static_cast<U8>(bytes[at + 3])} << 24);
+}
+
+// Calls visit(type, payload offset, waveform size) for every command with
+// the same bounds song::load enforces
+template <typename B, typename F>
+constexpr void walk(const B &bytes, F &&visit) {
+  const auto size = std::size(bytes);
+  if ((size < 4) || (bytes[0] != 'A') || (bytes[1] != 'X') ||
+      (bytes[2] != 'S') || (bytes[3] != 'D')) {
+    invalid_song("First 4 bytes of this song are not 'AXSD'!");
+  }
+  auto where = std::size_t{4};
+  while (where < size) {
+    const auto type = static_cast<U8>(bytes[where]);
+    const auto payload = where + 1;
+    const auto length = payload_size(type);
+    if ((payload + length) > size) {
+      invalid_song("This song is truncated!");
+    }
+    auto width = U32{0};
+    if ((type == static_cast<U8>(command_type::patch_data)) ||
+        (type == static_cast<U8>(command_type::drum_data))) {
+      width = read_u32(bytes, payload + 1);
+    }
+    if ((payload + length + width) > size) {
+      invalid_song("This song is truncated!");
+    }
+    visit(type, payload, width);
+    where = payload + length + width;
+  }
+}
+
+struct table_sizes {
+  std::size_t commands = 0;
+  std::size_t patches = 0;
+  std::size_t drums = 0;
+  std::size_t waveforms = 0;
+};
+
+template <typename B> constexpr table_sizes measure(const B &bytes) {
+  auto sizes = table_sizes{};
+  walk(bytes, [&sizes](U8 type, std::size_t, U32 width) {
+    sizes.commands++;
+    if (type == static_cast<U8>(command_type::patch_data)) {
+      sizes.patches++;
+    } else if (type == static_cast<U8>(command_type::drum_data)) {
+      sizes.drums++;
+    }
+    sizes.waveforms += width;
+  });
+  return sizes;
+}
+
+template <table_sizes S> struct song_image {
+  U16 version = 0;
+  song_tick_t ticks_end = 0;
+  song_tick_t ticks_per_second = 0;
+  std::array<std::pair<song_tick_t, command>, S.commands> commands{};
+  std::array<table_patch, S.patches> patches{};
+  std::array<table_patch, S.drums> drums{};
+  std::array<U8, S.waveforms> waveforms{};
+
+  constexpr song_tables tables() const {
+    return {.version = version,
+            .ticks_end = ticks_end,
+            .ticks_per_second = ticks_per_second,
+            .commands = commands,
+            .patches = patches,
+            .drums = drums,
+            .waveforms = waveforms};
+  }
+};
+
+// std::stable_sort is not constexpr yet, this is a bottom-up merge sort
+template <typename T, std::size_t N>
+constexpr void sort_by_tick(std::array<T, N> &items) {
+  auto scratch = items;
+  for (auto width = std::size_t{1}; width < N; width *= 2) {
+    for (auto lo = std::size_t{0}; lo < N; lo += width * 2) {
+      const auto mid = std::min(lo + width, N);
+      const auto hi = std::min(lo + (width * 2), N);
+      auto a = lo;
+      auto b = mid;
+      for (auto out = lo; out < hi; out++) {
+        // ties take the left run so file order survives
+        if ((b >= hi) || ((a < mid) && (items[a].first <= items[b].first))) {
+          scratch[out] = items[a++];
+        } else {
+          scratch[out] = items[b++];
+        }
+      }
+    }
+    std::swap(items, scratch);
+  }
+}
+
+template <const auto &Bytes> consteval auto decode() {
+  constexpr auto sizes = measure(Bytes);
+  auto image = song_image<sizes>{};
+  auto commands = std::size_t{0};
+  auto patches = std::size_t{0};
+  auto drums = std::size_t{0};
+  auto pool = U32{0};
+
+  auto u8 = [](std::size_t at) { return static_cast<U8>(Bytes[at]); };
+  auto u32 = [](std::size_t at) { return read_u32(Bytes, at); };
+  auto f32 = [](std::size_t at) {
+    return std::bit_cast<F32>(read_u32(Bytes, at));
+  };
+  auto copy_waveform = [&image, &pool, &u8](std::size_t at, U32 width) {
+    for (auto i = U32{0}; i < width; i++) {
+      image.waveforms[pool + i] = u8(at + i);
+    }
+    pool += width;
+  };
+
+  auto timed = [](song_tick_t tick, command c) { return std::pair{tick, c}; };
+
+  walk(Bytes, [&](U8 type, std::size_t at, U32 width) {
+    auto &&entry = image.commands[commands++];
+    switch (static_cast<command_type>(type)) {
+    case command_type::note_on:
+      entry = timed(u32(at), command_note_on{.channel = u8(at + 4),
+                                             .note = u8(at + 5),
+                                             .velocity = u8(at + 6)});
+      break;
+    case command_type::note_off:
+      entry = timed(u32(at), command_note_off{.channel = u8(at + 4)});
+      break;
+    case command_type::pitchwheel:
+      entry = timed(u32(at), command_pitchwheel{
+                                 .channel = u8(at + 4),
+                                 .bend = std::bit_cast<S32>(u32(at + 5))});
+      break;
+    case command_type::program_change:
+      entry = timed(u32(at), command_program_change{.channel = u8(at + 4),
+                                                    .program = u8(at + 5)});
+      break;
+    case command_type::patch_data:
+      image.patches[patches++] = table_patch{.id = u8(at),
+                                             .loop_start = u32(at + 5),
+                                             .loop_end = u32(at + 9),
+                                             .ratio = f32(at + 13),
+                                             .gain_L = f32(at + 17),
+                                             .gain_R = f32(at + 21),
+                                             .waveform_at = pool,
+                                             .waveform_size = width};
+      copy_waveform(at + 25, width);
+      entry = timed(0, command_patch_data{});
+      break;
+    case command_type::drum_data:
+      image.drums[drums++] = table_patch{.id = u8(at),
+                                         .loop_start = 0,
+                                         .loop_end = 0,
+                                         .ratio = f32(at + 5),
+                                         .gain_L = f32(at + 9),
+                                         .gain_R = f32(at + 13),
+                                         .waveform_at = pool,
+                                         .waveform_size = width};
+      copy_waveform(at + 17, width);
+      entry = timed(0, command_drum_data{});
+      break;
+    case command_type::version:
+      image.version = static_cast<U16>(u8(at) | (u8(at + 1) << 8));
+      entry = timed(0, command_version{.song_version = image.version});
+      break;
+    case command_type::rate:
+      image.ticks_per_second = u32(at);
+      entry = timed(0, command_rate{.song_rate = image.ticks_per_second});
+      break;
+    case command_type::end_of_track:
+      // like song::load, the marker lands on the previous end
+      entry = timed(image.ticks_end, command_end_of_track{});
+      image.ticks_end = u32(at);
+      break;
+    }
+  });
+  sort_by_tick(image.commands);
+  return image;
+}
+} // namespace embed_detail
+
+// The tables of a song decoded at compile time, kept in read-only data
+template <const auto &Bytes>
+inline constexpr auto embedded_song = embed_detail::decode<Bytes>();
+
+// A playable song over embedded_song<Bytes>, nothing is parsed and the
+// waveforms are borrowed from the tables rather than copied
+template <const auto &Bytes>
+song load_embedded(const load_options &options = {}) {
+  return song::load_tables(embedded_song<Bytes>.tables(), options);
+}
+} // namespace axolotlsd
@@ -14,332 +14,898 @@
 //   limitations under the License.
 // ============================================================================
 //   AxolotlSD for C++ source code
-#include "../include/axolotlsd.hpp"
+#include "axolotlsd_kernels.hpp"
+#include "axolotlsd_writer.hpp"
 #include <algorithm>
 #include <bit>
+#include <chrono>
 #include <cmath>
-#include <forward_list>
+#include <limits>
 #include <numbers>
 #include <stdexcept>
+#include <utility>
 
 using namespace axolotlsd;
+using namespace axolotlsd::kernels;
 
 constexpr static U32 MAGIC = 0x41585344; // "AXSD"
 constexpr static U16 CURRENT_VERSION = 0x0003;
 constexpr static F32 A440 = 440.0f;
 constexpr static F32 TUNE_COEFF = 44100.0f / A440;
 
-const static std::map<command_type, size_t> byte_sizes{
-    {command_type::note_on, sizeof(song_tick_t) + (sizeof(U8) * 3)},
-    {command_type::note_off, sizeof(song_tick_t) + (sizeof(U8) * 1)},
-    {command_type::pitchwheel,
-     sizeof(song_tick_t) + (sizeof(U8) * 1) + sizeof(U32)},
-    {command_type::program_change, sizeof(song_tick_t) + (sizeof(U8) * 2)},
+// Bytes following each command's type byte, 0 marks an unknown type
+constexpr static auto byte_sizes = [] {
+  auto sizes = std::array<U8, 256>{};
+  auto at = [&sizes](command_type type) -> U8 & {
+    return sizes[static_cast<U8>(type)];
+  };
+  at(command_type::note_on) = sizeof(song_tick_t) + (sizeof(U8) * 3);
+  at(command_type::note_off) = sizeof(song_tick_t) + (sizeof(U8) * 1);
+  at(command_type::pitchwheel) =
+      sizeof(song_tick_t) + (sizeof(U8) * 1) + sizeof(U32);
+  at(command_type::program_change) = sizeof(song_tick_t) + (sizeof(U8) * 2);
+
+  at(command_type::patch_data) =
+      sizeof(U8) + sizeof(U32) + sizeof(U32) + sizeof(U32) + (sizeof(F32) * 3);
+  at(command_type::drum_data) = sizeof(U8) + sizeof(U32) + (sizeof(F32) * 3);
+
+  at(command_type::version) = sizeof(U16);
+  at(command_type::rate) = sizeof(U32);
+  at(command_type::end_of_track) = sizeof(song_tick_t);
+  return sizes;
+}();
+
+constexpr static auto HALFBAND_REACH = 15;
+
+// Blackman windowed half-band lowpass, cutoff at a quarter of the rate
+constexpr static auto halfband = [] {
+  auto taps = std::array<F32, (HALFBAND_REACH * 2) + 1>{};
+  auto sum = 0.0;
+  for (auto t = 0; t < taps.size(); t++) {
+    const auto x = t - HALFBAND_REACH;
+    const auto sinc = (x == 0) ? 1.0
+                               : series_sin_pi(x / 2.0) /
+                                     (std::numbers::pi * x / 2.0);
+    const auto w = static_cast<F64>(t) / (taps.size() - 1);
+    const auto window = 0.42 - 0.5 * series_cos_pi(2.0 * w) +
+                        0.08 * series_cos_pi(4.0 * w);
+    taps[t] = static_cast<F32>(sinc * window);
+    sum += taps[t];
+  }
+  for (auto &&t : taps) {
+    t = static_cast<F32>(t / sum);
+  }
+  return taps;
+}();
+
+// Builds each octave from the one below with the half-band filter dilated by
+// 2^(level - 1) ("a trous"), so every level keeps the waveform's indexing and
+// loop points and only loses the top octave of the level below
+static std::vector<std::vector<F32>> build_mip_levels(const patch_t &patch,
+                                                      U8 count) {
+  const auto size = static_cast<S64>(patch.waveform.size());
+  auto base = std::vector<F32>(size);
+  std::transform(patch.waveform.begin(), patch.waveform.end(), base.begin(),
+                 [](auto &&b) { return normalize<F32>(b); });
+
+  auto levels = std::vector<std::vector<F32>>{};
+  for (auto level = 1; level <= count; level++) {
+    const auto spacing = S64{1} << (level - 1);
+    auto &&below = levels.empty() ? base : levels.back();
+    auto above = std::vector<F32>(size);
+    for (auto i = S64{0}; i < size; i++) {
+      auto sum = 0.0f;
+      for (auto t = 0; t < halfband.size(); t++) {
+        auto k = i + ((t - HALFBAND_REACH) * spacing);
+        if (k > patch.loop_end) {
+          k -= patch.loop_start;
+          k %= patch.loop_end - patch.loop_start;
+          k += patch.loop_start;
+        }
+        if ((k >= 0) && (k < size)) {
+          sum += below[k] * halfband[t];
+        }
+      }
+      above[i] = sum;
+    }
+    levels.emplace_back(std::move(above));
+  }
+  return levels;
+}
+
+// Builds a looping patch's mip levels now, or leaves them to materialize()
+static void prepare_mip_levels(patch_t &patch, const load_options &options) {
+  if ((options.mip_levels == 0) || (patch.loop_start == 0xFFFFFFFF) ||
+      (patch.loop_end <= patch.loop_start)) {
+    return;
+  }
+  if (options.lazy) {
+    patch.pending = std::make_shared<pending_mips>();
+    patch.pending->count = options.mip_levels;
+    // started here, so never first on an audio thread
+    prefetcher::shared();
+  } else {
+    patch.mip_levels = build_mip_levels(patch, options.mip_levels);
+  }
+}
 
-    {command_type::patch_data,
-     sizeof(U8) + sizeof(U32) + sizeof(U32) + sizeof(U32) + (sizeof(F32) * 3)},
-    {command_type::drum_data, sizeof(U8) + sizeof(U32) + (sizeof(F32) * 3)},
+void patch_t::materialize() const {
+  if (pending && !pending->ready.load(std::memory_order_acquire)) {
+    std::call_once(pending->once, [this] {
+      pending->levels = build_mip_levels(*this, pending->count);
+      pending->ready.store(true, std::memory_order_release);
+    });
+  }
+}
 
-    {command_type::version, sizeof(U16)},
-    {command_type::rate, sizeof(U32)},
-    {command_type::end_of_track, sizeof(song_tick_t)}};
+// The level whose band limit still fits a read step of this many samples
+static std::size_t mip_level_for(F32 step, std::size_t count) {
+  if ((step <= 1.0f) || (count == 0)) {
+    return 0;
+  }
+  auto exponent = 0;
+  const auto mantissa = std::frexp(step, &exponent);
+  const auto level = (mantissa == 0.5f) ? exponent - 1 : exponent;
+  return std::min(static_cast<std::size_t>(level), count);
+}
 
 static F32 calculate_12tet(U8 note, F32 bend) {
   return std::pow(2.0f, (note - 69.0f + bend) / 12.0f) * A440;
 }
 
-static F32 calculate_mix(F32 x, F32 y, F32 a) {
-  return (x * (1.0f - a)) + (y * a);
+// An octave is 12 * 4096 pitchwheel steps, split into 192 coarse by 256 fine
+constexpr static auto OCTAVE_STEPS = S64{12 * 4096};
+constexpr static auto pitch_coarse = [] {
+  auto table = std::array<F64, 192>{};
+  for (auto i = 0; i < table.size(); i++) {
+    table[i] = series_exp2(static_cast<F64>(i) / 192);
+  }
+  return table;
+}();
+constexpr static auto pitch_fine = [] {
+  auto table = std::array<F64, 256>{};
+  for (auto i = 0; i < table.size(); i++) {
+    table[i] = series_exp2(static_cast<F64>(i) / OCTAVE_STEPS);
+  }
+  return table;
+}();
+
+// calculate_12tet without std::pow, only exact operations on table entries
+static F32 table_12tet(U8 note, S32 wheel) {
+  const auto steps = ((S64{note} - 69) * 4096) + wheel;
+  auto octave = steps / OCTAVE_STEPS;
+  auto within = steps % OCTAVE_STEPS;
+  if (within < 0) {
+    within += OCTAVE_STEPS;
+    octave--;
+  }
+  const auto ratio = pitch_coarse[within >> 8] * pitch_fine[within & 0xFF];
+  return static_cast<F32>(std::ldexp(ratio, static_cast<int>(octave)) * A440);
 }
 
-player::player(U32 count, U32 freq, bool stereo)
-    : frequency{1.0f / freq}, in_stereo{stereo}, max_voices{count} {}
+template <typename T>
+basic_player<T>::basic_player(U32 count, U32 freq, bool stereo)
+    : frequency{1.0f / freq}, sample_rate{freq}, in_stereo{stereo},
+      max_voices{count} {}
 
-void player::put_environment(std::optional<environment> &&next_env) {
+template <typename T>
+void basic_player<T>::put_environment(std::optional<environment> &&next_env) {
   std::swap(env_params, next_env);
 }
 
-sfx &player::queue_sfx(sfx &&sound) {
-  current_sfx.emplace_back(sound);
+template <typename T> sfx &basic_player<T>::queue_sfx(sfx &&sound) {
+  // finished sounds are reclaimed here, off the audio thread
+  std::erase_if(current_sfx, [](auto &&s) { return s.finished(); });
+  current_sfx.emplace_back(std::move(sound));
   return current_sfx.back();
 }
 
-void player::play() {
+// Builds every lazily loaded patch now, so a deterministic player never
+// renders from level 0 while the prefetcher catches up
+static void materialize_all(const song &s) {
+  for (auto &&[_, patch] : s.patches) {
+    patch.materialize();
+  }
+}
+
+template <typename T> void basic_player<T>::play() {
+  // reserve polyphony upfront so note-ons never allocate during tick
+  voices.reserve(max_voices);
+
+  if (!current) {
+    fail<std::runtime_error>("No song loaded to play");
+  }
+  rewind();
+
+  if (current->version != CURRENT_VERSION) {
+    fail<std::runtime_error>("Version mismatch in wanted song");
+  }
+  if (deterministic) {
+    materialize_all(*current);
+  }
+
+  echo_cursor = 0;
+  playback = true;
+
+  prefetch = (prefetch_ticks > 0) ? &prefetcher::shared() : nullptr;
+  request_prefetch();
+}
+
+// Back to the current song's first tick with nothing sounding, never
+// allocates so the audio thread can do it between blocks
+template <typename T> void basic_player<T>::rewind() {
   for (auto i = 0; i < 16; i++) {
     switch (i) {
     case 9: {
-      channels[9].reset(new drum_group);
+      channels[9] = drum_group{};
       break;
     }
     default: {
-      channels[i].reset(new voice_group);
+      channels[i] = voice_group{};
       break;
     }
     }
   }
 
+  voices.clear();
   std::for_each(patch_ids.begin(), patch_ids.end(),
                 [](auto &&p) { p = std::nullopt; });
 
   seconds_elapsed = 0.0f;
-  seconds_end = current.ticks_end / static_cast<F32>(current.ticks_per_second);
-
-  if (current.version != CURRENT_VERSION) {
-    throw std::runtime_error{"Version mismatch in wanted song"};
-  }
+  seconds_end =
+      current->ticks_end / static_cast<F32>(current->ticks_per_second);
+  frames_elapsed = 0;
+  frames_end =
+      (U64{current->ticks_end} * sample_rate) / current->ticks_per_second;
 
   on_voices = 0;
   cursor = 0;
-  echo_cursor = 0;
   last_cursor = std::nullopt;
+  prefetched_until = 0;
+}
+
+template <typename T>
+void basic_player<T>::queue_song(std::shared_ptr<const song> next) {
+  if (!next) {
+    fail<std::runtime_error>("No song to queue");
+  }
+  if (next->version != CURRENT_VERSION) {
+    fail<std::runtime_error>("Version mismatch in wanted song");
+  }
+  if (deterministic) {
+    materialize_all(*next);
+  }
+  // the song this replaces, or the one the audio thread swapped out, is
+  // released here rather than in the middle of a block
+  auto retired = std::shared_ptr<const song>{};
+  auto held = std::unique_lock{handover_lock};
+  retired = std::exchange(handover, std::move(next));
+  handover_waiting = true;
+}
+
+template <typename T> void basic_player<T>::take_handover() {
+  auto held = std::unique_lock{handover_lock, std::try_to_lock};
+  if (!held.owns_lock() || !handover_waiting) {
+    return;
+  }
+  std::swap(current, handover);
+  handover_waiting = false;
+  rewind();
   playback = true;
+  request_prefetch();
 }
 
-void voice_group::accumulate_into(const patch_t &patch, F32 &l, F32 &r) {
-  std::for_each(voices.begin(), voices.end(), [&patch, &l, &r](auto &&v) {
-    auto sample = 0.0f;
-    auto here = static_cast<U32>(std::floor(patch.ratio * v.phase));
-    const auto can_loop = patch.loop_start != 0xFFFFFFFF;
+// Frames until a read position moving by step first reaches limit
+static S64 frames_until(F32 position, F32 step, S64 limit, S64 most) {
+  if (step <= 0.0f) {
+    return most;
+  }
+  const auto frames = std::ceil((limit - position) / step);
+  return std::clamp(static_cast<S64>(frames), S64{1}, most);
+}
 
-    if (can_loop && (here > patch.loop_end)) {
-      if (v.key) {
-        here -= patch.loop_start;
-        here %= patch.loop_end - patch.loop_start;
-        here += patch.loop_start;
+// Moves a voice's envelope on by some seconds, returning the level it ends
+// at; the caller ramps linearly between levels so this runs once per block
+static F32 advance_envelope(voice_pool &pool, std::size_t v,
+                            const std::optional<envelope_t> &envelope,
+                            F32 seconds) {
+  if (!envelope.has_value()) {
+    return 1.0f;
+  }
+  auto &&env = envelope.value();
+  auto &&level = pool.level[v];
+  auto &&stage = pool.stage[v];
+  if ((!pool.keyed(v)) && (stage != envelope_stage::release)) {
+    stage = envelope_stage::release;
+  }
+
+  // each stage either eats all the time left or finishes and hands over
+  while (seconds > 0.0f) {
+    switch (stage) {
+    case envelope_stage::attack: {
+      const auto need = (1.0f - level) * env.attack;
+      if (need > seconds) {
+        level += seconds / env.attack;
+        return level;
       }
+      seconds -= need;
+      level = 1.0f;
+      stage = envelope_stage::decay;
+      break;
     }
-    if (here >= patch.waveform.size()) {
-      v.active = false;
-    } else {
-      sample = (static_cast<F32>(patch.waveform.at(here)) - 128.0f) / 128.0f;
+    case envelope_stage::decay: {
+      const auto rate = (1.0f - env.sustain) / env.decay;
+      if ((rate > 0.0f) && ((level - env.sustain) > (seconds * rate))) {
+        level -= seconds * rate;
+        return level;
+      }
+      level = env.sustain;
+      stage = envelope_stage::sustain;
+      return level;
     }
-    v.phase += v.phase_add_by;
-    v.phase = std::fmod(v.phase, patch.ratio * patch.waveform.size() * 2.0f);
-
-    l += sample * v.velocity * patch.gain_L;
-    r += sample * v.velocity * patch.gain_R;
-  });
-}
-
-void drum_group::accumulate_into(const drum_map_t &mapping, F32 &l, F32 &r) {
-  std::for_each(voices.begin(), voices.end(), [&mapping, &l, &r](auto &&d) {
-    auto sample = 0.0f;
-    auto &&map_found = mapping.find(d.note);
-    auto gain_L = 0.0f;
-    auto gain_R = 0.0f;
-
-    if (map_found != mapping.end()) {
-      auto &&[_, patch] = *map_found;
-      auto here = static_cast<U32>(patch.ratio * d.phase);
-      if (here >= patch.waveform.size()) {
-        d.active = false;
-      } else {
-        sample = (static_cast<F32>(patch.waveform.at(here)) - 128.0f) / 128.0f;
+    case envelope_stage::sustain: {
+      return level;
+    }
+    case envelope_stage::release: {
+      const auto need = level * env.release;
+      if (need > seconds) {
+        level -= seconds / env.release;
+        return level;
       }
-      gain_L = patch.gain_L;
-      gain_R = patch.gain_R;
-      d.phase += d.phase_add_by;
-    } else {
-      d.active = false;
+      level = 0.0f;
+      pool.flags[v] &= ~voice_pool::ACTIVE;
+      return level;
+    }
     }
+  }
+  return level;
+}
 
-    l += sample * d.velocity * gain_L;
-    r += sample * d.velocity * gain_R;
-  });
+// Hands the run to the dispatched kernel when every read lands inside
+// [0, limit), otherwise reads go through the loop and bounds checks
+template <channel_layout L, interpolation I, typename S, typename T,
+          typename P>
+static void render_segment(const S &source, P &&checked, S64 limit,
+                           F32 position, F32 step, const frame_t<L, T> &gain,
+                           T level, T slope, T *mix, S64 frames) {
+  constexpr auto edges = reach<I>();
+  const auto extent = run_extent<T>(position, step, frames);
+  const auto first = extent[0] - edges[0];
+  const auto last = extent[1] + edges[1];
+  if ((first >= 0) && (last < limit)) {
+    using V = typename S::value_type;
+    const auto args = run_args<V, T>{.source = source.data(),
+                                     .position = position,
+                                     .step = step,
+                                     .gain = {gain.front(), gain.back()},
+                                     .level = level,
+                                     .slope = slope,
+                                     .mix = mix,
+                                     .frames = frames};
+    active<T>().template run<V>(L, I)(args);
+  } else {
+    render_run<L, I>(checked, position, step, gain, level, slope, mix, frames);
+  }
 }
 
-void player::handle_one(F32 &l, F32 &r) {
-  cursor = static_cast<U32>(current.ticks_per_second * seconds_elapsed);
-  if ((!last_cursor.has_value()) || (cursor > last_cursor.value())) {
-    auto [begin, end] = current.commands.equal_range(cursor);
-    std::for_each(begin, end, [this](auto &&epair) {
-      auto &&[_, e] = epair;
-      switch (e->get_type()) {
-      case command_type::note_on: {
-        if (on_voices < max_voices) {
-          auto &&ptr = static_cast<command_note_on *>(e.get());
-          auto &&ch = channels[ptr->channel];
-          if (ch->is_drum_kit()) {
-            auto &&ch_casted = static_cast<drum_group *>(ch.get());
-            auto phase = A440 * frequency * 32.0f * std::numbers::pi;
-            ch_casted->voices.emplace_back(ptr->velocity / 127.0f, phase,
-                                           ptr->note);
-          } else {
-            auto &&ch_casted = static_cast<voice_group *>(ch.get());
-            auto phase = calculate_12tet(ptr->note, ch_casted->bend) *
-                         frequency * TUNE_COEFF;
-            ch_casted->voices.emplace_back(ptr->velocity / 127.0f, phase,
-                                           ptr->note);
-          }
-        }
-        break;
+// The loudest a voice gets over a run, for culling
+template <channel_layout L>
+static F32 loudest(const frame_t<L> &gain, F32 level, F32 level_end) {
+  auto most = 0.0f;
+  for (auto &&g : gain) {
+    most = std::max(most, std::abs(g));
+  }
+  return most * std::max(std::abs(level), std::abs(level_end));
+}
+
+template <channel_layout L, interpolation I, typename T>
+bool voice_pool::accumulate_patch(std::size_t v, const patch_t &patch, T *mix,
+                                  U32 frames, const render_params &params) {
+  constexpr auto N = static_cast<S64>(L);
+  const auto size = static_cast<S64>(patch.waveform.size());
+  const auto can_loop = (patch.loop_start != 0xFFFFFFFF) &&
+                        (patch.loop_end > patch.loop_start);
+  const auto loop_length = static_cast<S64>(patch.loop_end) - patch.loop_start;
+
+  auto gain = spread<L>(patch.gain_L, patch.gain_R);
+  for (auto &&g : gain) {
+    g *= velocity[v];
+  }
+  const auto step = patch.ratio * phase_add_by[v];
+  auto &&levels = patch.mips();
+  const auto mip = mip_level_for(step, levels.size());
+  auto position = patch.ratio * phase[v];
+  const auto start = patch.envelope.has_value() ? level[v] : 1.0f;
+  const auto end =
+      advance_envelope(*this, v, patch.envelope, frames * params.frequency);
+  const auto slope = (end - start) / frames;
+  const auto audible = loudest<L>(gain, start, end) >= params.cull_below;
+  const auto sample_gain = to_samples<T>(gain);
+
+  auto render = [&](auto &&source) {
+    auto done = S64{0};
+    while (done < frames) {
+      const auto looping = can_loop && keyed(v);
+      auto here = static_cast<S64>(std::floor(position));
+
+      // wrap once per segment instead of once per frame
+      if (looping && (here > patch.loop_end)) {
+        const auto loops = (here - patch.loop_start) / loop_length;
+        position -= static_cast<F32>(loops * loop_length);
+        here = static_cast<S64>(std::floor(position));
       }
-      case command_type::note_off: {
-        auto &&ptr = static_cast<command_note_off *>(e.get());
-        auto &&voices = channels[ptr->channel]->voices;
-        if (!voices.empty()) {
-          auto &&first_on = std::find_if(voices.begin(), voices.end(),
-                                         [](auto &&v) { return v.key; });
-          if (first_on != voices.end()) {
-            (*first_on).key = false;
-          }
-        }
-        break;
+      if ((here < 0) || (here >= size)) {
+        flags[v] &= ~ACTIVE;
+        return;
       }
-      case command_type::pitchwheel: {
-        auto &&ptr = static_cast<command_pitchwheel *>(e.get());
-        auto &&ch = channels[ptr->channel];
-        if (!ch->is_drum_kit()) {
-          auto &&ch_casted = static_cast<voice_group *>(ch.get());
-          ch_casted->bend = ptr->bend / 4096.0f;
-          std::for_each(ch_casted->voices.begin(), ch_casted->voices.end(),
-                        [this, &ch_casted](auto &&c) {
-                          c.phase_add_by =
-                              calculate_12tet(c.note, ch_casted->bend) *
-                              frequency * TUNE_COEFF;
-                        });
+
+      const auto limit =
+          looping ? std::min<S64>(patch.loop_end + 1, size) : size;
+      const auto run = frames_until(position, step, limit, frames - done);
+      auto checked = [&patch, &source, size, looping](S64 k) {
+        if (looping && (k > patch.loop_end)) {
+          k -= patch.loop_start;
+          k %= patch.loop_end - patch.loop_start;
+          k += patch.loop_start;
         }
-        break;
-      }
-      case command_type::program_change: {
-        auto &&ptr = static_cast<command_program_change *>(e.get());
-        patch_ids[ptr->channel] = ptr->program;
-        break;
-      }
-      default: {
-        break;
-      }
-      }
-    });
-    last_cursor = cursor;
-  }
-  on_voices = 0;
-  for (auto i = 0; i < 16; i++) {
-    auto &&ch_ptr = channels.at(i);
-    std::erase_if(ch_ptr->voices, [](auto &&v) { return !v.active; });
-    if (ch_ptr->is_drum_kit()) {
-      auto &&channel = static_cast<drum_group *>(ch_ptr.get());
-      channel->accumulate_into(current.drums, l, r);
-      on_voices += channel->voices.size();
-    } else {
-      auto &&channel = static_cast<voice_group *>(ch_ptr.get());
-      if (patch_ids.at(i).has_value()) {
-        const auto &patch = current.patches.at(*(patch_ids.at(i)));
-        channel->accumulate_into(patch, l, r);
-        on_voices += channel->voices.size();
+        if ((k < 0) || (k >= size)) {
+          return T{};
+        }
+        return normalize<T>(source[k]);
+      };
+      if (audible) {
+        render_segment<L, I>(source, checked, limit, position, step,
+                             sample_gain,
+                             static_cast<T>(start + (done * slope)),
+                             static_cast<T>(slope), mix + (done * N), run);
       }
+      position += run * step;
+      done += run;
     }
+  };
+  if (mip == 0) {
+    render(patch.waveform);
+  } else {
+    render(levels[mip - 1]);
+  }
+  if (patch.ratio != 0.0f) {
+    phase[v] = position / patch.ratio;
   }
+  return !audible;
 }
 
-void player::maybe_echo_one(F32 &l, F32 &r) {
-  if (env_params.has_value()) {
-    auto &&env = env_params.value();
+template <channel_layout L, interpolation I, typename T>
+bool voice_pool::accumulate_drum(std::size_t v, const drum_t &patch, T *mix,
+                                 U32 frames, const render_params &params) {
+  auto gain = spread<L>(patch.gain_L, patch.gain_R);
+  for (auto &&g : gain) {
+    g *= velocity[v];
+  }
+  const auto size = static_cast<S64>(patch.waveform.size());
+  const auto step = patch.ratio * phase_add_by[v];
+  const auto position = patch.ratio * phase[v];
+  if (static_cast<S64>(std::floor(position)) >= size) {
+    flags[v] &= ~ACTIVE;
+    return false;
+  }
 
-    echo_buffer_L[echo_cursor] += l;
-    echo_buffer_R[echo_cursor] += r;
-
-    if (env.fir_filter.has_value()) {
-      auto &&fir = env.fir_filter.value();
-      auto fir_l = 0.0f;
-      auto fir_r = 0.0f;
-      auto iter = 0;
-      for (auto &&f : fir) {
-        const auto fir_cursor = (echo_cursor - iter) % env.cursor_max;
-        fir_l += echo_buffer_L[fir_cursor] * f;
-        fir_r += echo_buffer_R[fir_cursor] * f;
-        iter++;
+  const auto start = patch.envelope.has_value() ? level[v] : 1.0f;
+  const auto end =
+      advance_envelope(*this, v, patch.envelope, frames * params.frequency);
+  const auto slope = (end - start) / frames;
+  const auto audible = loudest<L>(gain, start, end) >= params.cull_below;
+
+  // drums never loop, so a whole block is at most one segment
+  const auto run = frames_until(position, step, size, frames);
+  if (audible) {
+    auto checked = [&patch, size](S64 k) {
+      if ((k < 0) || (k >= size)) {
+        return T{};
       }
-      echo_buffer_L[echo_cursor] += fir_l / 64.0f;
-      echo_buffer_R[echo_cursor] += fir_r / 64.0f;
+      return normalize<T>(patch.waveform[k]);
+    };
+    render_segment<L, I>(patch.waveform, checked, size, position, step,
+                         to_samples<T>(gain), static_cast<T>(start),
+                         static_cast<T>(slope), mix, run);
+  }
+  if (run < frames) {
+    flags[v] &= ~ACTIVE;
+  }
+  phase[v] += run * phase_add_by[v];
+  return !audible;
+}
+
+void voice_pool::reserve(std::size_t count) {
+  phase.reserve(count);
+  phase_add_by.reserve(count);
+  velocity.reserve(count);
+  level.reserve(count);
+  note.reserve(count);
+  channel.reserve(count);
+  stage.reserve(count);
+  flags.reserve(count);
+}
+
+void voice_pool::clear() {
+  phase.clear();
+  phase_add_by.clear();
+  velocity.clear();
+  level.clear();
+  note.clear();
+  channel.clear();
+  stage.clear();
+  flags.clear();
+  per_channel.fill(0);
+}
+
+void voice_pool::add(U8 which, U8 key, F32 loudness, F32 add_by) {
+  phase.emplace_back(0.0f);
+  phase_add_by.emplace_back(add_by);
+  velocity.emplace_back(loudness);
+  level.emplace_back(0.0f);
+  note.emplace_back(key);
+  channel.emplace_back(which);
+  stage.emplace_back(envelope_stage::attack);
+  flags.emplace_back(KEY | ACTIVE);
+  per_channel[which]++;
+}
+
+// Drops inactive voices, keeping the rest in note-on order so note-offs
+// still release the oldest held voice of a channel
+void voice_pool::compact() {
+  auto kept = std::size_t{0};
+  per_channel.fill(0);
+  for (auto v = std::size_t{0}; v < size(); v++) {
+    if ((flags[v] & ACTIVE) == 0) {
+      continue;
+    }
+    if (kept != v) {
+      phase[kept] = phase[v];
+      phase_add_by[kept] = phase_add_by[v];
+      velocity[kept] = velocity[v];
+      level[kept] = level[v];
+      note[kept] = note[v];
+      channel[kept] = channel[v];
+      stage[kept] = stage[v];
+      flags[kept] = flags[v];
     }
+    per_channel[channel[kept]]++;
+    kept++;
+  }
+  phase.resize(kept);
+  phase_add_by.resize(kept);
+  velocity.resize(kept);
+  level.resize(kept);
+  note.resize(kept);
+  channel.resize(kept);
+  stage.resize(kept);
+  flags.resize(kept);
+}
 
-    echo_buffer_L[echo_cursor] *= env.feedback_L;
-    echo_buffer_R[echo_cursor] *= env.feedback_R;
+// Resolves the player's interpolation quality into a kernel instantiation
+template <typename F>
+static void with_quality(interpolation quality, F &&accumulate) {
+  switch (quality) {
+  case interpolation::none: {
+    accumulate.template operator()<interpolation::none>();
+    break;
+  }
+  case interpolation::linear: {
+    accumulate.template operator()<interpolation::linear>();
+    break;
+  }
+  case interpolation::cubic: {
+    accumulate.template operator()<interpolation::cubic>();
+    break;
+  }
+  case interpolation::sinc: {
+    accumulate.template operator()<interpolation::sinc>();
+    break;
+  }
+  }
+}
 
-    // protect against clipping
-    echo_buffer_L[echo_cursor] =
-        std::clamp(echo_buffer_L[echo_cursor], -1.0f, 1.0f);
-    echo_buffer_R[echo_cursor] =
-        std::clamp(echo_buffer_R[echo_cursor], -1.0f, 1.0f);
+template <typename T> void basic_player<T>::handle_events() {
+  cursor = deterministic
+               ? static_cast<U32>((frames_elapsed * current->ticks_per_second) /
+                                  sample_rate)
+               : static_cast<U32>(current->ticks_per_second * seconds_elapsed);
+  auto pitch_of = [this](U8 note, const voice_group &group) {
+    const auto hz = deterministic ? table_12tet(note, group.wheel)
+                                  : calculate_12tet(note, group.bend);
+    return hz * frequency * TUNE_COEFF;
+  };
+  if ((!last_cursor.has_value()) || (cursor > last_cursor.value())) {
+    auto [begin, end] = std::equal_range(
+        current->commands.begin(), current->commands.end(),
+        std::pair<song_tick_t, command>{cursor, command_end_of_track{}},
+        [](auto &&a, auto &&b) { return a.first < b.first; });
+    std::for_each(begin, end, [this, &pitch_of](auto &&epair) {
+      auto &&[_, e] = epair;
+      std::visit(
+          [this, &pitch_of](auto &&c) {
+            using C = std::decay_t<decltype(c)>;
+            if constexpr (std::is_same_v<C, command_note_on>) {
+              if (on_voices < max_voices) {
+                on_voices++;
+                auto &&ch = channels[c.channel];
+                if (std::holds_alternative<drum_group>(ch)) {
+                  auto phase = A440 * frequency * 32.0f * std::numbers::pi;
+                  voices.add(c.channel, c.note, c.velocity / 127.0f, phase);
+                } else {
+                  auto phase = pitch_of(c.note, std::get<voice_group>(ch));
+                  voices.add(c.channel, c.note, c.velocity / 127.0f, phase);
+                }
+              }
+            } else if constexpr (std::is_same_v<C, command_note_off>) {
+              for (auto v = std::size_t{0}; v < voices.size(); v++) {
+                if ((voices.channel[v] == c.channel) && voices.keyed(v)) {
+                  voices.flags[v] &= ~voice_pool::KEY;
+                  break;
+                }
+              }
+            } else if constexpr (std::is_same_v<C, command_pitchwheel>) {
+              auto &&group = std::get_if<voice_group>(&channels[c.channel]);
+              if (group != nullptr) {
+                group->bend = c.bend / 4096.0f;
+                group->wheel = c.bend;
+                for (auto v = std::size_t{0}; v < voices.size(); v++) {
+                  if (voices.channel[v] == c.channel) {
+                    voices.phase_add_by[v] = pitch_of(voices.note[v], *group);
+                  }
+                }
+              }
+            } else if constexpr (std::is_same_v<C, command_program_change>) {
+              patch_ids[c.channel] = c.program;
+            }
+          },
+          e);
+    });
+    if (!last_cursor.has_value()) {
+      // started over, everything behind the cursor is materialized
+      prefetched_until = cursor;
+    }
+    last_cursor = cursor;
+    request_prefetch();
+  }
+}
 
-    l = calculate_mix(l, echo_buffer_L[echo_cursor], env.wet_L);
-    r = calculate_mix(r, echo_buffer_R[echo_cursor], env.wet_R);
-    echo_cursor++;
-    echo_cursor %= env.cursor_max;
+// Never builds mip levels here, the voice plays level 0 until they are ready
+template <typename T>
+void basic_player<T>::hand_to_prefetcher(const patch_t &patch) {
+  if (patch.materialized() || patch.pending->queued.exchange(true)) {
+    return;
+  }
+  if (!prefetcher::shared().request(current, patch)) {
+    // the queue was busy, the next block asks again
+    patch.pending->queued = false;
   }
 }
 
-void player::handle_sfx(F32 &l, F32 &r) {
-  std::for_each(current_sfx.begin(), current_sfx.end(), [&l, &r](auto &&s) {
-    s.accumulator -= s.pitch;
-    const auto sfx_byte = static_cast<F32>(S16{s.data.front()} - 127) / 128.0f;
-    l += sfx_byte * s.pan_L;
-    r += sfx_byte * s.pan_R;
-    s.data.pop_front();
-    while (s.accumulator < 1.0f) {
-      if (s.data.empty()) {
+template <typename T> void basic_player<T>::request_prefetch() {
+  const auto until = cursor + prefetch_ticks + 1;
+  if (prefetch && (until > prefetched_until) &&
+      prefetch->request(current, prefetched_until, until)) {
+    prefetched_until = until;
+  }
+}
+
+// Moves song time along by up to most frames, stopping early where the next
+// frame would land on a new tick (or the song loops), returns frames covered
+template <typename T> U32 basic_player<T>::advance(U32 most) {
+  auto frames = U32{0};
+  if (deterministic) {
+    // whole frames, the loop point and tick edges land on exact frames
+    while (true) {
+      frames++;
+      frames_elapsed++;
+      if (frames_elapsed > frames_end) {
+        frames_elapsed = (frames_end > 0) ? frames_elapsed % frames_end : 0;
+        last_cursor = std::nullopt;
+        break;
+      }
+      if ((frames >= most) ||
+          (((frames_elapsed * current->ticks_per_second) / sample_rate) >
+           last_cursor.value())) {
         break;
       }
-      s.data.pop_front();
-      s.accumulator += 1.0f;
     }
-  });
-  std::erase_if(current_sfx, [](auto &&s) { return s.data.empty(); });
-  l = std::clamp(l, -1.0f, 1.0f);
-  r = std::clamp(r, -1.0f, 1.0f);
-}
-
-void player::tick(std::vector<F32> &audio) {
-  const auto size = audio.size();
-  if (in_stereo) {
-    // Stereo
-    for (auto i = 0; i < size; i += 2) {
-      auto l = 0.0f;
-      auto r = 0.0f;
-
-      if (playback) {
-        handle_one(l, r);
-        seconds_elapsed += frequency;
-        if (seconds_elapsed > seconds_end) {
-          seconds_elapsed = std::fmod(seconds_elapsed, seconds_end);
-          last_cursor = std::nullopt;
-        }
+    seconds_elapsed = static_cast<F32>(frames_elapsed) * frequency;
+    return frames;
+  }
+  while (true) {
+    frames++;
+    seconds_elapsed += frequency;
+    if (seconds_elapsed > seconds_end) {
+      seconds_elapsed = std::fmod(seconds_elapsed, seconds_end);
+      last_cursor = std::nullopt;
+      break;
+    }
+    if ((frames >= most) ||
+        (static_cast<U32>(current->ticks_per_second * seconds_elapsed) >
+         last_cursor.value())) {
+      break;
+    }
+  }
+  return frames;
+}
+
+template <typename T>
+template <channel_layout L>
+void basic_player<T>::accumulate_voices(T *mix, U32 frames) {
+  const auto params = render_params{
+      .frequency = frequency,
+      .cull_below = (master_volume > 0.0f)
+                        ? cull_threshold / master_volume
+                        : std::numeric_limits<F32>::infinity()};
+  voices.compact();
+  on_voices = voices.size();
+  if (voices.size() == 0) {
+    return;
+  }
+
+  // silent channels cost one check, their patch is never looked up
+  auto patches = std::array<const patch_t *, 16>{nullptr};
+  for (auto i = 0; i < 16; i++) {
+    if ((voices.per_channel[i] > 0) && patch_ids[i].has_value() &&
+        std::holds_alternative<voice_group>(channels[i])) {
+      auto &&found = current->patches.find(*patch_ids[i]);
+      if (found != current->patches.end()) {
+        // a song loaded mid-play keeps the last one's program changes
+        patches[i] = &found->second;
+        hand_to_prefetcher(found->second);
       }
-      
-      l *= master_volume;
-      r *= master_volume;
-      
-      handle_sfx(l, r);
-      maybe_echo_one(l, r);
-      audio[i + 0] = std::clamp(l, -1.0f, 1.0f);
-      audio[i + 1] = std::clamp(r, -1.0f, 1.0f);
     }
-  } else {
-    // Mono
-    for (auto i = 0; i < size; i += 1) {
-      auto l = 0.0f;
-      auto r = 0.0f;
-
-      if (playback) {
-        handle_one(l, r);
-        seconds_elapsed += frequency;
-        if (seconds_elapsed > seconds_end) {
-          seconds_elapsed = std::fmod(seconds_elapsed, seconds_end);
-          last_cursor = std::nullopt;
+  }
+
+  with_quality(quality, [this, mix, frames, &params,
+                         &patches]<interpolation I>() {
+    for (auto v = std::size_t{0}; v < voices.size(); v++) {
+      const auto which = voices.channel[v];
+      if (std::holds_alternative<drum_group>(channels[which])) {
+        auto &&found = current->drums.find(voices.note[v]);
+        if (found == current->drums.end()) {
+          voices.flags[v] &= ~voice_pool::ACTIVE;
+        } else if (voices.template accumulate_drum<L, I>(
+                       v, found->second, mix, frames, params)) {
+          culled_voices++;
         }
+      } else if (patches[which] == nullptr) {
+        // no program or no such patch, it would hold its slot forever. The
+        // slot frees at the next compact(), not here, or note-ons before it
+        // would grow the pool past max_voices.
+        voices.flags[v] &= ~voice_pool::ACTIVE;
+      } else if (voices.template accumulate_patch<L, I>(
+                     v, *patches[which], mix, frames, params)) {
+        culled_voices++;
       }
+    }
+  });
+}
+
+template <typename T>
+template <channel_layout L>
+void basic_player<T>::maybe_echo(U32 frames) {
+  if (env_params.has_value()) {
+    auto &&env = env_params.value();
+    // a mono layout only ever runs the left echo line
+    const auto feedback = spread<L>(env.feedback_L, env.feedback_R);
+    const auto wet = spread<L>(env.wet_L, env.wet_R);
+    auto state = echo_state<T>{
+        .buffers = {echo_buffer_L, echo_buffer_R},
+        .cursor = echo_cursor,
+        .cursor_max = env.cursor_max,
+        .feedback = {static_cast<T>(feedback.front()),
+                     static_cast<T>(feedback.back())},
+        .wet = {static_cast<T>(wet.front()), static_cast<T>(wet.back())},
+        .filtered = env.fir_filter.has_value(),
+        .fir = to_samples<T>(env.fir_filter.value_or(std::array<F32, 8>{}))};
+    active<T>().echo[static_cast<U32>(L) - 1](state, mix_buffer.data(), frames);
+    echo_cursor = state.cursor;
+  }
+}
+
+template <typename T>
+template <channel_layout L>
+void basic_player<T>::handle_sfx(U32 frames) {
+  constexpr auto N = static_cast<U32>(L);
+  auto &&kernel = active<T>();
+  std::for_each(current_sfx.begin(), current_sfx.end(),
+                [this, &kernel, frames](auto &&s) {
+                  kernel.mix_sfx[N - 1](s, mix_buffer.data(), frames);
+                });
+  kernel.clamp(mix_buffer.data(), frames * N);
+}
+
+// Song and voices are mixed into mix_buffer in event-free runs, the per
+// frame stages (volume, sfx, echo) then go over the block in place
+template <typename T>
+template <channel_layout L>
+void basic_player<T>::render_block(U32 frames) {
+  constexpr auto N = static_cast<U32>(L);
+  std::fill_n(mix_buffer.begin(), frames * N, T{});
+
+  take_handover();
+  if (playback) {
+    auto done = U32{0};
+    while (done < frames) {
+      handle_events();
+      const auto run = advance(frames - done);
+      accumulate_voices<L>(mix_buffer.data() + (done * N), run);
+      done += run;
+    }
+  }
+
+  // every stage only looks at its own frame, so going stage by stage over
+  // the block matches going frame by frame through the stages
+  active<T>().scale(mix_buffer.data(), frames * N,
+                    static_cast<T>(master_volume));
+  handle_sfx<L>(frames);
+  maybe_echo<L>(frames);
+}
 
-      l *= master_volume;
-      r *= master_volume;
-      
-      handle_sfx(l, r);
-      maybe_echo_one(l, r);
-      audio[i] = std::clamp((l + r) / 2.0f, -1.0f, 1.0f);
+// Picks the channel layout once per call, then renders block by block and
+// hands each interleaved block to the writer
+template <typename T, typename W>
+static void render_frames(basic_player<T> &p, std::size_t frames, W &&write) {
+  constexpr auto BLOCK = basic_player<T>::BLOCK_FRAMES;
+  p.culled_voices = 0;
+  auto blocks = [&p, frames, &write]<channel_layout L>() {
+    for (auto i = std::size_t{0}; i < frames; i += BLOCK) {
+      const auto block =
+          static_cast<U32>(std::min<std::size_t>(BLOCK, frames - i));
+      p.template render_block<L>(block);
+      write(i, p.mix_buffer.data(), block, static_cast<U32>(L));
     }
+  };
+  if (p.in_stereo) {
+    blocks.template operator()<channel_layout::stereo>();
+  } else {
+    blocks.template operator()<channel_layout::mono>();
   }
 }
 
+template <typename T> void basic_player<T>::tick(std::vector<F32> &audio) {
+  tick(std::span<F32>{audio});
+}
+
+template <typename T> void basic_player<T>::tick(std::span<F32> audio) {
+  const auto stride = in_stereo ? 2 : 1;
+  auto &&kernel = active<T>();
+  render_frames(*this, audio.size() / stride,
+                [&audio, &kernel](auto i, auto mix, auto frames, auto n) {
+                  kernel.to_f32(mix, audio.data() + (i * n), frames * n);
+                });
+}
+
+template <typename T>
+void basic_player<T>::tick(std::span<S16> audio, bool dither) {
+  const auto stride = in_stereo ? 2 : 1;
+  auto &&kernel = active<T>();
+  auto state = dither ? &dither_state : nullptr;
+  render_frames(*this, audio.size() / stride,
+                [&audio, &kernel, state](auto i, auto mix, auto frames,
+                                         auto n) {
+                  kernel.to_s16(mix, audio.data() + (i * n), frames * n,
+                                state);
+                });
+}
+
+// Planar output, a mono player writes the same mix into both planes
+template <typename T>
+void basic_player<T>::tick(std::span<F32> left, std::span<F32> right) {
+  const auto size = std::min(left.size(), right.size());
+  auto &&kernel = active<T>();
+  render_frames(*this, size,
+                [&left, &right, &kernel](auto i, auto mix, auto frames,
+                                         auto n) {
+                  for (auto f = U32{0}; f < frames; f++) {
+                    kernel.to_f32(mix + (f * n), &left[i + f], 1);
+                    kernel.to_f32(mix + (f * n) + n - 1, &right[i + f], 1);
+                  }
+                });
+}
+
 std::array<F32, 8> environment::parse_sfc_echo(std::array<U8, 8> &&in) {
   auto filter = std::array<F32, 8>{0.0f};
   for (auto i = 0; i < 8; i++) {
@@ -348,363 +914,500 @@ std::array<F32, 8> environment::parse_sfc_echo(std::array<U8, 8> &&in) {
   return filter;
 }
 // This convenience loads an "xxd -i" format song dump
-void player::load_xxd_format(unsigned char *data, unsigned int len) {
+template <typename T>
+void basic_player<T>::load_xxd_format(unsigned char *data, unsigned int len,
+                                      const load_options &options) {
   auto vec = std::vector<U8>{};
   vec.resize(len);
   for (auto i = 0; i < len; i++) {
     vec[i] = data[i];
   }
-  current = song::load(vec);
+  load(song::load(vec, options));
 }
-void player::load(song &&next) {
-	std::swap(current, next);
+template <typename T> void basic_player<T>::load(song &&next) {
+  load(std::make_shared<const song>(std::move(next)));
 }
-
-sfx sfx::load_xxd_format(unsigned char *data, unsigned int len) {
-  auto list = std::list<U8>{};
-  for (auto i = 0; i < len; i++) {
-    list.emplace_back(data[i]);
-  }
-  return sfx{.data = list};
+template <typename T>
+void basic_player<T>::load(std::shared_ptr<const song> next) {
+  std::swap(current, next);
 }
 
-song song::load(std::vector<U8> &data) {
-  auto where = 4;
-  auto end = data.size();
-  auto &&the_song = song{};
-  auto continue_for = 0;
-  auto continue_data = std::forward_list<U8>{};
+template struct axolotlsd::basic_player<F32>;
+template struct axolotlsd::basic_player<F64>;
+template struct axolotlsd::basic_player<fixed_t>;
 
-  auto magic_data = std::vector<U32>{data[0], data[1], data[2], data[3]};
-  auto magic_concat = (magic_data[3] << 0) | (magic_data[2] << 8) |
-                      (magic_data[1] << 16) | (magic_data[0] << 24);
+sfx sfx::load_xxd_format(unsigned char *data, unsigned int len) {
+  return sfx{.data = std::vector<U8>(data, data + len)};
+}
 
-  if (magic_concat != MAGIC) {
-    throw std::runtime_error{"First 4 bytes of this song are not 'AXSD'!"};
+const char *load_error::what() const {
+  switch (kind) {
+  case load_error_kind::bad_magic: {
+    return "First 4 bytes of this song are not 'AXSD'!";
+  }
+  case load_error_kind::unknown_command: {
+    return "This song has a command of unknown type";
   }
+  case load_error_kind::truncated: {
+    return "This song ends partway through a command";
+  }
+  case load_error_kind::cancelled: {
+    return "This song load was cancelled";
+  }
+  }
+  return "This song failed to load";
+}
 
-  auto data_byte = 0;
+static U32 read_u32(std::span<const U8> data, std::size_t at) {
+  return (U32{data[at]} << 0) | (U32{data[at + 1]} << 8) |
+         (U32{data[at + 2]} << 16) | (U32{data[at + 3]} << 24);
+}
 
-  while (where < end) {
-    data_byte = data.at(where);
+// Calls visit(type, payload offset, waveform size) for each command in turn
+// and stops at the first that does not fit, nothing is read out of bounds
+template <typename F>
+static std::optional<load_error> scan(std::span<const U8> data, F &&visit) {
+  if ((data.size() < 4) ||
+      (((U32{data[0]} << 24) | (U32{data[1]} << 16) | (U32{data[2]} << 8) |
+        (U32{data[3]} << 0)) != MAGIC)) {
+    return load_error{.kind = load_error_kind::bad_magic, .offset = 0};
+  }
 
-    auto what_value = static_cast<command_type>(data_byte);
-    continue_for = byte_sizes.at(what_value);
+  auto where = std::size_t{4};
+  while (where < data.size()) {
+    const auto type = static_cast<command_type>(data[where]);
+    const auto size = std::size_t{byte_sizes[data[where]]};
+    if (size == 0) {
+      return load_error{.kind = load_error_kind::unknown_command,
+                        .offset = where};
+    }
+    const auto payload = where + 1;
+    const auto left = data.size() - payload;
+    if (size > left) {
+      return load_error{.kind = load_error_kind::truncated, .offset = where};
+    }
+    // patches and drums are followed by their samples
+    auto width = U32{0};
+    if ((type == command_type::patch_data) ||
+        (type == command_type::drum_data)) {
+      width = read_u32(data, payload + 1);
+    }
+    if (width > left - size) {
+      return load_error{.kind = load_error_kind::truncated, .offset = where};
+    }
+    visit(type, payload, width);
+    where = payload + size + width;
+  }
+  return std::nullopt;
+}
 
-    while (continue_for > 0) {
-      where++;
-      data_byte = data.at(where);
-      continue_data.emplace_front(data_byte);
-      continue_for--;
+song song::load(std::vector<U8> &data, const load_options &options) {
+  auto loaded = try_load(data, options);
+  if (!loaded) {
+    auto &&error = loaded.error();
+    if (error.kind == load_error_kind::bad_magic) {
+      fail<std::runtime_error>(error.what());
     }
-    continue_data.reverse();
+    fail<std::out_of_range>(error.what());
+  }
+  return std::move(*loaded);
+}
 
-    switch (what_value) {
-    case command_type::drum_data: {
-      // initialize pointer
-      auto &&command_ptr = new command_drum_data{};
-
-      // initialize bytes
-      auto drum = continue_data.front();
-      continue_data.pop_front();
-
-      // get sample size
-      auto width = std::vector<U32>{0, 0, 0, 0};
-      std::for_each(width.begin(), width.end(), [&continue_data](auto &&w) {
-        w = continue_data.front();
-        continue_data.pop_front();
-      });
-      auto width_calc = (width[0] << 0) | (width[1] << 8) | (width[2] << 16) |
-                        (width[3] << 24);
-
-      // get ratio, conscientious of the floating point nature
-      auto ratio_castee = std::vector<U32>{0, 0, 0, 0};
-      std::for_each(ratio_castee.begin(), ratio_castee.end(),
-                    [&continue_data](auto &&r) {
-                      r = continue_data.front();
-                      continue_data.pop_front();
-                    });
-      auto ratio_calc =
-          std::bit_cast<F32>((ratio_castee[0] << 0) | (ratio_castee[1] << 8) |
-                             (ratio_castee[2] << 16) | (ratio_castee[3] << 24));
-
-      // get gain, conscientious of the floating point nature
-      auto gainL_castee = std::vector<U32>{0, 0, 0, 0};
-      std::for_each(gainL_castee.begin(), gainL_castee.end(),
-                    [&continue_data](auto &&g) {
-                      g = continue_data.front();
-                      continue_data.pop_front();
-                    });
-      auto gainL_calc =
-          std::bit_cast<F32>((gainL_castee[0] << 0) | (gainL_castee[1] << 8) |
-                             (gainL_castee[2] << 16) | (gainL_castee[3] << 24));
-      auto gainR_castee = std::vector<U32>{0, 0, 0, 0};
-      std::for_each(gainR_castee.begin(), gainR_castee.end(),
-                    [&continue_data](auto &&g) {
-                      g = continue_data.front();
-                      continue_data.pop_front();
-                    });
-      auto gainR_calc =
-          std::bit_cast<F32>((gainR_castee[0] << 0) | (gainR_castee[1] << 8) |
-                             (gainR_castee[2] << 16) | (gainR_castee[3] << 24));
-      auto drum_data = drum_t{};
-      drum_data.waveform.resize(width_calc);
-      drum_data.ratio = ratio_calc;
-      drum_data.gain_L = gainL_calc;
-      drum_data.gain_R = gainR_calc;
-
-      // sample is loaded here
-      std::for_each(drum_data.waveform.begin(), drum_data.waveform.end(),
-                    [&data, &where](auto &&b) { b = data.at(++where); });
-      the_song.drums.insert({drum, drum_data});
-
-      // dispatch pointer
-      the_song.commands.emplace(0, command_ptr);
-      break;
+load_result<song> song::try_load(std::span<const U8> data,
+                                 const load_options &options) {
+  auto &&the_song = song{};
+
+  // lazily loaded waveforms all point into one copy of the source
+  auto source = (options.lazy && !options.intern)
+                    ? std::make_shared<const patch_data_t>(data.begin(),
+                                                           data.end())
+                    : nullptr;
+  auto waveform_at = [&data, &source, &options](std::size_t at, U32 width) {
+    const auto bytes = data.subspan(at, width);
+    if (options.intern) {
+      return waveform_store::global().intern(bytes);
     }
-    case command_type::patch_data: {
-      // initialize pointer
-      auto &&command_ptr = new command_patch_data{};
-
-      // initialize bytes
-      auto patch = continue_data.front();
-      continue_data.pop_front();
-
-      // get sample size
-      auto width = std::vector<U32>{0, 0, 0, 0};
-      std::for_each(width.begin(), width.end(), [&continue_data](auto &&w) {
-        w = continue_data.front();
-        continue_data.pop_front();
-      });
-      auto width_calc = (width[0] << 0) | (width[1] << 8) | (width[2] << 16) |
-                        (width[3] << 24);
-
-      // get start point (if 0xFFFFFFFF we aren't looping)
-      auto start = std::vector<U32>{0, 0, 0, 0};
-      std::for_each(start.begin(), start.end(), [&continue_data](auto &&s) {
-        s = continue_data.front();
-        continue_data.pop_front();
-      });
-      auto start_calc = (start[0] << 0) | (start[1] << 8) | (start[2] << 16) |
-                        (start[3] << 24);
-
-      // get end point
-      auto end = std::vector<U32>{0, 0, 0, 0};
-      std::for_each(end.begin(), end.end(), [&continue_data](auto &&e) {
-        e = continue_data.front();
-        continue_data.pop_front();
-      });
-      auto end_calc =
-          (end[0] << 0) | (end[1] << 8) | (end[2] << 16) | (end[3] << 24);
-
-      // get ratio, conscientious of the floating point nature
-      auto ratio_castee = std::vector<U32>{0, 0, 0, 0};
-      std::for_each(ratio_castee.begin(), ratio_castee.end(),
-                    [&continue_data](auto &&r) {
-                      r = continue_data.front();
-                      continue_data.pop_front();
-                    });
-      auto ratio_calc =
-          std::bit_cast<F32>((ratio_castee[0] << 0) | (ratio_castee[1] << 8) |
-                             (ratio_castee[2] << 16) | (ratio_castee[3] << 24));
-
-      // get gain, conscientious of the floating point nature
-      auto gainL_castee = std::vector<U32>{0, 0, 0, 0};
-      std::for_each(gainL_castee.begin(), gainL_castee.end(),
-                    [&continue_data](auto &&g) {
-                      g = continue_data.front();
-                      continue_data.pop_front();
-                    });
-      auto gainL_calc =
-          std::bit_cast<F32>((gainL_castee[0] << 0) | (gainL_castee[1] << 8) |
-                             (gainL_castee[2] << 16) | (gainL_castee[3] << 24));
-      auto gainR_castee = std::vector<U32>{0, 0, 0, 0};
-      std::for_each(gainR_castee.begin(), gainR_castee.end(),
-                    [&continue_data](auto &&g) {
-                      g = continue_data.front();
-                      continue_data.pop_front();
-                    });
-      auto gainR_calc =
-          std::bit_cast<F32>((gainR_castee[0] << 0) | (gainR_castee[1] << 8) |
-                             (gainR_castee[2] << 16) | (gainR_castee[3] << 24));
-      auto patch_data = patch_t{};
-      patch_data.waveform.resize(width_calc);
-      patch_data.loop_start = start_calc;
-      patch_data.loop_end = end_calc;
-      patch_data.ratio = ratio_calc;
-      patch_data.gain_L = gainL_calc;
-      patch_data.gain_R = gainR_calc;
-
-      // sample is loaded here
-      std::for_each(patch_data.waveform.begin(), patch_data.waveform.end(),
-                    [&data, &where](auto &&b) { b = data.at(++where); });
-      the_song.patches.insert({patch, patch_data});
-
-      // dispatch pointer
-      the_song.commands.emplace(0, command_ptr);
-      break;
+    if (source) {
+      return waveform_t{std::span{*source}.subspan(at, width), source};
     }
-
+    return waveform_t::own(patch_data_t(bytes.begin(), bytes.end()));
+  };
+  auto u32 = [&data](std::size_t at) { return read_u32(data, at); };
+  auto f32 = [&data](std::size_t at) {
+    return std::bit_cast<F32>(read_u32(data, at));
+  };
+
+  const auto failed = scan(data, [&](command_type type, std::size_t at,
+                                     U32 width) {
+    auto &&commands = the_song.commands;
+    switch (type) {
     case command_type::note_on: {
-      // initialize pointer
-      auto &&command_ptr = new command_note_on{};
-
-      // initialize time
-      auto time = std::vector<song_tick_t>{0, 0, 0, 0};
-      std::for_each(time.begin(), time.end(), [&continue_data](auto &&t) {
-        t = continue_data.front();
-        continue_data.pop_front();
-      });
-
-      // initialize bytes
-      command_ptr->channel = continue_data.front();
-      continue_data.pop_front();
-      command_ptr->note = continue_data.front();
-      continue_data.pop_front();
-      command_ptr->velocity = continue_data.front();
-      continue_data.pop_front();
-
-      // dispatch pointer
-      the_song.commands.emplace((time[0] << 0) | (time[1] << 8) |
-                                    (time[2] << 16) | (time[3] << 24),
-                                command_ptr);
+      commands.emplace_back(u32(at), command_note_on{.channel = data[at + 4],
+                                                     .note = data[at + 5],
+                                                     .velocity = data[at + 6]});
       break;
     }
     case command_type::note_off: {
-      // initialize pointer
-      auto &&command_ptr = new command_note_off{};
-
-      // initialize time
-      auto &&time = std::vector<song_tick_t>{0, 0, 0, 0};
-      std::for_each(time.begin(), time.end(), [&continue_data](auto &&t) {
-        t = continue_data.front();
-        continue_data.pop_front();
-      });
-
-      // initialize bytes
-      command_ptr->channel = continue_data.front();
-      continue_data.pop_front();
-
-      // dispatch pointer
-      the_song.commands.emplace((time[0] << 0) | (time[1] << 8) |
-                                    (time[2] << 16) | (time[3] << 24),
-                                command_ptr);
+      commands.emplace_back(u32(at),
+                            command_note_off{.channel = data[at + 4]});
       break;
     }
     case command_type::pitchwheel: {
-      // initialize pointer
-      auto &&command_ptr = new command_pitchwheel{};
-
-      // initialize time
-      auto &&time = std::vector<song_tick_t>{0, 0, 0, 0};
-      std::for_each(time.begin(), time.end(), [&continue_data](auto &&t) {
-        t = continue_data.front();
-        continue_data.pop_front();
-      });
-
-      // initialize bytes
-      command_ptr->channel = continue_data.front();
-      continue_data.pop_front();
-
-      // initialize bend
-      auto &&bend_vec = std::vector<U32>{0, 0, 0, 0};
-      std::for_each(bend_vec.begin(), bend_vec.end(),
-                    [&continue_data](auto &&b) {
-                      b = continue_data.front();
-                      continue_data.pop_front();
-                    });
-      auto bend = (bend_vec[0] << 0) | (bend_vec[1] << 8) |
-                  (bend_vec[2] << 16) | (bend_vec[3] << 24);
-      // bit cast to signed
-      command_ptr->bend = std::bit_cast<S32>(bend);
-
-      // dispatch pointer
-      the_song.commands.emplace((time[0] << 0) | (time[1] << 8) |
-                                    (time[2] << 16) | (time[3] << 24),
-                                command_ptr);
+      commands.emplace_back(
+          u32(at), command_pitchwheel{.channel = data[at + 4],
+                                      .bend = std::bit_cast<S32>(u32(at + 5))});
       break;
     }
     case command_type::program_change: {
-      // initialize pointer
-      auto &&command_ptr = new command_program_change{};
-
-      // initialize time
-      auto &&time = std::vector<song_tick_t>{0, 0, 0, 0};
-      std::for_each(time.begin(), time.end(), [&continue_data](auto &&t) {
-        t = continue_data.front();
-        continue_data.pop_front();
-      });
-
-      // initialize bytes
-      command_ptr->channel = continue_data.front();
-      continue_data.pop_front();
-      command_ptr->program = continue_data.front();
-      continue_data.pop_front();
-
-      // dispatch pointer
-      the_song.commands.emplace((time[0] << 0) | (time[1] << 8) |
-                                    (time[2] << 16) | (time[3] << 24),
-                                command_ptr);
+      commands.emplace_back(u32(at),
+                            command_program_change{.channel = data[at + 4],
+                                                   .program = data[at + 5]});
+      break;
+    }
+    case command_type::patch_data: {
+      // id, width, loop start (0xFFFFFFFF when not looping) and end, ratio,
+      // then gains
+      auto patch = patch_t{};
+      patch.loop_start = u32(at + 5);
+      patch.loop_end = u32(at + 9);
+      patch.ratio = f32(at + 13);
+      patch.gain_L = f32(at + 17);
+      patch.gain_R = f32(at + 21);
+      patch.waveform = waveform_at(at + byte_sizes[static_cast<U8>(type)],
+                                   width);
+      prepare_mip_levels(patch, options);
+      the_song.patches.insert({data[at], std::move(patch)});
+      commands.emplace_back(0, command_patch_data{});
+      break;
+    }
+    case command_type::drum_data: {
+      // id, width, ratio, then gains
+      auto drum = drum_t{};
+      drum.ratio = f32(at + 5);
+      drum.gain_L = f32(at + 9);
+      drum.gain_R = f32(at + 13);
+      drum.waveform = waveform_at(at + byte_sizes[static_cast<U8>(type)],
+                                  width);
+      the_song.drums.insert({data[at], std::move(drum)});
+      commands.emplace_back(0, command_drum_data{});
       break;
     }
     case command_type::version: {
-      // initialize pointer
-      auto &&command_ptr = new command_version{};
-
-      // initialize version
-      auto &&ver = std::vector<U16>{0, 0};
-      std::for_each(ver.begin(), ver.end(), [&continue_data](auto &&v) {
-        v = continue_data.front();
-        continue_data.pop_front();
-      });
-      command_ptr->song_version = (ver[0] << 0) | (ver[1] << 8);
-
-      the_song.version = command_ptr->song_version;
-
-      // dispatch pointer
-      the_song.commands.emplace(0, command_ptr);
+      the_song.version = static_cast<U16>(data[at] | (data[at + 1] << 8));
+      commands.emplace_back(0,
+                            command_version{.song_version = the_song.version});
       break;
     }
     case command_type::rate: {
-      // initialize pointer
-      auto &&command_ptr = new command_rate{};
-
-      // initialize version
-      auto &&rate = std::vector<U32>{0, 0, 0, 0};
-      std::for_each(rate.begin(), rate.end(), [&continue_data](auto &&r) {
-        r = continue_data.front();
-        continue_data.pop_front();
-      });
-      command_ptr->song_rate =
-          (rate[0] << 0) | (rate[1] << 8) | (rate[2] << 16) | (rate[3] << 24);
-
-      the_song.ticks_per_second = command_ptr->song_rate;
-
-      // dispatch pointer
-      the_song.commands.emplace(0, command_ptr);
+      the_song.ticks_per_second = u32(at);
+      commands.emplace_back(
+          0, command_rate{.song_rate = the_song.ticks_per_second});
       break;
     }
     case command_type::end_of_track: {
-      // initialize pointer
-      auto &&command_ptr = new command_end_of_track{};
+      // the marker goes on the end as it stood before this command
+      commands.emplace_back(the_song.ticks_end, command_end_of_track{});
+      the_song.ticks_end = u32(at);
+      break;
+    }
+    }
+  });
+  if (failed) {
+    return {*failed};
+  }
 
-      // initialize version
-      auto &&time = std::vector<song_tick_t>{0, 0, 0, 0};
-      std::for_each(time.begin(), time.end(), [&continue_data](auto &&e) {
-        e = continue_data.front();
-        continue_data.pop_front();
-      });
+  std::stable_sort(the_song.commands.begin(), the_song.commands.end(),
+                   [](auto &&a, auto &&b) { return a.first < b.first; });
+  return {std::move(the_song)};
+}
 
-      // dispatch pointer
-      the_song.commands.emplace(the_song.ticks_end, command_ptr);
+std::optional<load_error> song::validate(std::span<const U8> data) {
+  return scan(data, [](command_type, std::size_t, U32) {});
+}
 
-      the_song.ticks_end =
-          (time[0] << 0) | (time[1] << 8) | (time[2] << 16) | (time[3] << 24);
-      break;
+song song::load_tables(const song_tables &tables,
+                       const load_options &options) {
+  auto &&the_song = song{.version = tables.version,
+                         .ticks_end = tables.ticks_end,
+                         .ticks_per_second = tables.ticks_per_second};
+  the_song.commands.assign(tables.commands.begin(), tables.commands.end());
+
+  auto slice = [&tables](const table_patch &p) {
+    if ((std::size_t{p.waveform_at} + p.waveform_size) >
+        tables.waveforms.size()) {
+      fail<std::runtime_error>("A table waveform is past the pool's end!");
+    }
+    return waveform_t::borrow(
+        tables.waveforms.subspan(p.waveform_at, p.waveform_size));
+  };
+  for (auto &&p : tables.patches) {
+    auto patch = patch_t{};
+    patch.waveform = slice(p);
+    patch.ratio = p.ratio;
+    patch.gain_L = p.gain_L;
+    patch.gain_R = p.gain_R;
+    patch.loop_start = p.loop_start;
+    patch.loop_end = p.loop_end;
+    prepare_mip_levels(patch, options);
+    the_song.patches.insert({p.id, std::move(patch)});
+  }
+  for (auto &&d : tables.drums) {
+    auto drum = drum_t{};
+    drum.waveform = slice(d);
+    drum.ratio = d.ratio;
+    drum.gain_L = d.gain_L;
+    drum.gain_R = d.gain_R;
+    the_song.drums.insert({d.id, std::move(drum)});
+  }
+  return the_song;
+}
+
+std::vector<U8> song::save() const {
+  auto bytes = std::vector<U8>{};
+  auto w = writer{bytes};
+  // the magic is the one big endian field
+  for (auto shift : {24, 16, 8, 0}) {
+    w.u8(static_cast<U8>(MAGIC >> shift));
+  }
+
+  w.u8(static_cast<U8>(command_type::version));
+  w.u16(version);
+  w.u8(static_cast<U8>(command_type::rate));
+  w.u32(ticks_per_second);
+
+  for (auto &&[id, patch] : patches) {
+    w.u8(static_cast<U8>(command_type::patch_data));
+    w.u8(id);
+    w.u32(static_cast<U32>(patch.waveform.size()));
+    w.u32(patch.loop_start);
+    w.u32(patch.loop_end);
+    w.f32(patch.ratio);
+    w.f32(patch.gain_L);
+    w.f32(patch.gain_R);
+    bytes.insert(bytes.end(), patch.waveform.begin(), patch.waveform.end());
+  }
+  for (auto &&[id, drum] : drums) {
+    w.u8(static_cast<U8>(command_type::drum_data));
+    w.u8(id);
+    w.u32(static_cast<U32>(drum.waveform.size()));
+    w.f32(drum.ratio);
+    w.f32(drum.gain_L);
+    w.f32(drum.gain_R);
+    bytes.insert(bytes.end(), drum.waveform.begin(), drum.waveform.end());
+  }
+
+  // the meta and sample commands only mark where the loader found them,
+  // what they carry was already written above
+  for (auto &&[tick, held] : commands) {
+    std::visit(
+        [&w, tick](auto &&c) {
+          using C = std::decay_t<decltype(c)>;
+          if constexpr (std::is_same_v<C, command_note_on>) {
+            w.timed(C::type, tick, c.channel);
+            w.u8(c.note);
+            w.u8(c.velocity);
+          } else if constexpr (std::is_same_v<C, command_note_off>) {
+            w.timed(C::type, tick, c.channel);
+          } else if constexpr (std::is_same_v<C, command_pitchwheel>) {
+            w.timed(C::type, tick, c.channel);
+            w.u32(std::bit_cast<U32>(c.bend));
+          } else if constexpr (std::is_same_v<C, command_program_change>) {
+            w.timed(C::type, tick, c.channel);
+            w.u8(c.program);
+          }
+        },
+        held);
+  }
+
+  w.u8(static_cast<U8>(command_type::end_of_track));
+  w.u32(ticks_end);
+  return bytes;
+}
+
+prefetcher::prefetcher() : worker{&prefetcher::work, this} {}
+
+prefetcher::~prefetcher() {
+  {
+    auto held = std::unique_lock{lock};
+    stopping = true;
+  }
+  wake.notify_one();
+  worker.join();
+}
+
+prefetcher &prefetcher::shared() {
+  static auto instance = prefetcher{};
+  return instance;
+}
+
+bool prefetcher::request(const std::shared_ptr<const song> &next,
+                         song_tick_t first, song_tick_t last) {
+  return push(job{.target = next, .from = first, .until = last});
+}
+
+bool prefetcher::request(const std::shared_ptr<const song> &next,
+                         const patch_t &patch) {
+  return push(job{.target = next, .patch = &patch});
+}
+
+bool prefetcher::push(job &&next) {
+  auto held = std::unique_lock{lock, std::try_to_lock};
+  if (!held.owns_lock() || (queued == jobs.size())) {
+    return false;
+  }
+  // the slot's song was already moved out by the worker, nothing is freed
+  jobs[(head + queued) % jobs.size()] = std::move(next);
+  queued++;
+  held.unlock();
+  wake.notify_one();
+  return true;
+}
+
+void prefetcher::work() {
+  auto held = std::unique_lock{lock};
+  while (true) {
+    wake.wait(held, [this] { return stopping || (queued > 0); });
+    if (stopping) {
+      return;
     }
+    auto next = std::move(jobs[head]);
+    head = (head + 1) % jobs.size();
+    queued--;
+    held.unlock();
+
+    if (next.patch != nullptr) {
+      next.patch->materialize();
+    } else {
+      auto &&commands = next.target->commands;
+      auto begin = std::lower_bound(
+          commands.begin(), commands.end(), next.from,
+          [](auto &&a, song_tick_t tick) { return a.first < tick; });
+      for (auto it = begin; (it != commands.end()) && (it->first < next.until);
+           it++) {
+        auto &&change = std::get_if<command_program_change>(&it->second);
+        if (change != nullptr) {
+          auto &&found = next.target->patches.find(change->program);
+          if (found != next.target->patches.end()) {
+            found->second.materialize();
+          }
+        }
+      }
     }
-    where++;
+    // a song nothing else holds is freed here, off the audio thread
+    next = job{};
+    held.lock();
   }
+}
 
-  return the_song;
+player_pool::player_pool(U32 block_frames, U32 count) : frames{block_frames} {
+  count = std::max(count, U32{1});
+  for (auto i = 0; i < count; i++) {
+    queues.emplace_back(new worker_queue);
+  }
+  for (auto i = 0; i < count; i++) {
+    workers.emplace_back(&player_pool::work, this, i);
+  }
+}
+
+player_pool::~player_pool() {
+  {
+    auto lock = std::unique_lock{state_lock};
+    stopping = true;
+  }
+  block_start.notify_all();
+  std::for_each(workers.begin(), workers.end(), [](auto &&w) { w.join(); });
+}
+
+// Only call this between blocks, the returned buffer is rewritten by render()
+// and stays valid for the pool's lifetime
+std::vector<F32> &player_pool::add(player &p) {
+  const auto index = static_cast<U32>(players.size());
+  players.emplace_back(&p);
+  outputs.emplace_back(frames * (p.in_stereo ? 2 : 1));
+
+  auto &&queue = queues[index % queues.size()];
+  auto lock = std::unique_lock{queue->lock};
+  queue->home.emplace_back(index);
+  queue->jobs.reserve(queue->home.size());
+  return outputs.back();
+}
+
+player_pool::block_report player_pool::render() {
+  const auto start = std::chrono::steady_clock::now();
+  stolen = 0;
+
+  {
+    auto lock = std::unique_lock{state_lock};
+    remaining = players.size();
+    std::for_each(queues.begin(), queues.end(), [](auto &&q) {
+      auto queue_lock = std::unique_lock{q->lock};
+      q->jobs.assign(q->home.begin(), q->home.end());
+      q->head = 0;
+    });
+    generation++;
+  }
+  block_start.notify_all();
+
+  {
+    auto lock = std::unique_lock{state_lock};
+    block_done.wait(lock, [this] { return remaining == 0; });
+  }
+
+  const auto elapsed = std::chrono::steady_clock::now() - start;
+  return block_report{
+      .wall_seconds = std::chrono::duration<F64>(elapsed).count(),
+      .stolen = stolen.load()};
+}
+
+void player_pool::work(U32 id) {
+  auto seen = U64{0};
+  while (true) {
+    {
+      auto lock = std::unique_lock{state_lock};
+      block_start.wait(
+          lock, [this, &seen] { return stopping || (generation != seen); });
+      if (stopping) {
+        return;
+      }
+      seen = generation;
+    }
+    while (run_one(id)) {
+    }
+  }
+}
+
+bool player_pool::run_one(U32 id) {
+  auto job = std::optional<U32>{std::nullopt};
+
+  // our own players first, oldest first
+  {
+    auto &&queue = queues[id];
+    auto lock = std::unique_lock{queue->lock};
+    if (queue->head < queue->jobs.size()) {
+      job = queue->jobs[queue->head++];
+    }
+  }
+
+  // then steal from the back of everyone else
+  for (auto i = 1; (!job.has_value()) && (i < queues.size()); i++) {
+    auto &&queue = queues[(id + i) % queues.size()];
+    auto lock = std::unique_lock{queue->lock};
+    if (queue->head < queue->jobs.size()) {
+      job = queue->jobs.back();
+      queue->jobs.pop_back();
+      stolen++;
+    }
+  }
+
+  if (!job.has_value()) {
+    return false;
+  }
+
+  players[*job]->tick(std::span<F32>{outputs[*job]});
+
+  auto lock = std::unique_lock{state_lock};
+  if (--remaining == 0) {
+    block_done.notify_all();
+  }
+  return true;
 }
@@ -0,0 +1,411 @@
+// ============================================================================
+//   Copyright 2023 Roland Metivier <metivier.roland@chlorophyt.us>
+//
+//   Licensed under the Apache License, Version 2.0 (the "License");
+//   you may not use this file except in compliance with the License.
+//   You may obtain a copy of the License at
+//
+//       http://www.apache.org/licenses/LICENSE-2.0
+//
+//   Unless required by applicable law or agreed to in writing, software
+//   distributed under the License is distributed on an "AS IS" BASIS,
+//   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+//   See the License for the specific language governing permissions and
+//   limitations under the License.
+// ============================================================================
+//   AxolotlSD for C++ precompiled song images
+//
+//   An image is a header followed by fixed size tables and two pools, found
+//   through the header's offsets and stored little endian:
+//
+//     header | commands | patches | drums | waveform pool | mip pool
+//
+//   Nothing is variable length except the pools, so loading is bounds
+//   checks and straight copies. Mip levels are stored already built.
+//   Version 2 checksums whole words rather than single bytes.
+#include "axolotlsd_writer.hpp"
+#include <bit>
+
+using namespace axolotlsd;
+
+constexpr static U32 IMAGE_MAGIC = 0x41585343; // "AXSC"
+constexpr static U16 IMAGE_VERSION = 0x0002;
+
+struct image_header {
+  U32 magic;
+  U16 image_version;
+  U16 song_version;
+  U32 ticks_end;
+  U32 ticks_per_second;
+  U64 source_hash;
+  // over every byte after the header
+  U64 checksum = 0;
+  U32 command_count;
+  U32 patch_count;
+  U32 drum_count;
+  U32 commands_at = 0;
+  U32 patches_at = 0;
+  U32 drums_at = 0;
+  U32 waveforms_at = 0;
+  U32 mips_at = 0;
+  U64 size = 0;
+};
+struct image_command {
+  song_tick_t tick;
+  command_type type;
+  U8 channel = 0;
+  U8 a = 0;
+  U8 b = 0;
+  S32 value = 0;
+};
+struct image_envelope {
+  U8 present;
+  U8 padding[3]{};
+  F32 attack;
+  F32 decay;
+  F32 sustain;
+  F32 release;
+};
+struct image_patch {
+  U8 id;
+  U8 mip_count;
+  U8 padding[2]{};
+  U32 loop_start;
+  U32 loop_end;
+  F32 ratio;
+  F32 gain_L;
+  F32 gain_R;
+  image_envelope envelope;
+  U32 waveform_at;
+  U32 waveform_size;
+  // mip level i is waveform_size values starting waveform_size * i in
+  U32 mip_at;
+};
+struct image_drum {
+  U8 id;
+  U8 padding[3]{};
+  F32 ratio;
+  F32 gain_L;
+  F32 gain_R;
+  image_envelope envelope;
+  U32 waveform_at;
+  U32 waveform_size;
+};
+static_assert(sizeof(image_header) == 72);
+static_assert(sizeof(image_command) == 12);
+static_assert(sizeof(image_patch) == 56);
+static_assert(sizeof(image_drum) == 44);
+
+// Records are copied as they sit in memory, which only matches the format
+// on a little endian host
+static void check_host() {
+  if constexpr (std::endian::native != std::endian::little) {
+    fail<std::runtime_error>("Compiled song images need little endian");
+  }
+}
+
+// FNV-1a, cheap and the same everywhere
+static U64 fnv1a(std::span<const U8> bytes) {
+  auto hash = U64{0xCBF29CE484222325};
+  for (auto &&b : bytes) {
+    hash ^= b;
+    hash *= U64{0x100000001B3};
+  }
+  return hash;
+}
+
+U64 axolotlsd::source_hash(std::span<const U8> bytes) { return fnv1a(bytes); }
+
+// FNV-1a over 8 byte words in four independent lanes, so the multiplies
+// overlap, with the tail taken a byte at a time
+static U64 image_checksum(std::span<const U8> bytes) {
+  constexpr auto PRIME = U64{0x100000001B3};
+  constexpr auto STRIDE = sizeof(U64) * 4;
+  auto lanes = std::array<U64, 4>{};
+  for (auto l = std::size_t{0}; l < lanes.size(); l++) {
+    lanes[l] = U64{0xCBF29CE484222325} + l;
+  }
+  const auto whole = bytes.size() - (bytes.size() % STRIDE);
+  for (auto at = std::size_t{0}; at < whole; at += STRIDE) {
+    auto words = std::array<U64, 4>{};
+    std::memcpy(words.data(), bytes.data() + at, STRIDE);
+    for (auto l = std::size_t{0}; l < lanes.size(); l++) {
+      lanes[l] = (lanes[l] ^ words[l]) * PRIME;
+    }
+  }
+  auto hash = fnv1a(bytes.subspan(whole));
+  for (auto &&lane : lanes) {
+    hash = (hash ^ lane) * PRIME;
+  }
+  return hash;
+}
+
+constexpr static auto TRUNCATED = "Compiled song image is truncated";
+
+// A whole table in one bounds check and one copy
+template <typename R>
+static std::vector<R> get_table(std::span<const U8> image, std::size_t at,
+                                U32 count) {
+  const auto size = std::size_t{count} * sizeof(R);
+  if ((at > image.size()) || (image.size() - at < size)) {
+    fail<std::runtime_error>(TRUNCATED);
+  }
+  auto records = std::vector<R>(count);
+  std::memcpy(records.data(), image.data() + at, size);
+  return records;
+}
+
+static image_envelope envelope_of(const patch_base_t &patch) {
+  if (!patch.envelope.has_value()) {
+    return image_envelope{};
+  }
+  auto &&env = patch.envelope.value();
+  return image_envelope{.present = 1,
+                        .attack = env.attack,
+                        .decay = env.decay,
+                        .sustain = env.sustain,
+                        .release = env.release};
+}
+static std::optional<envelope_t> envelope_from(const image_envelope &env) {
+  if (env.present == 0) {
+    return std::nullopt;
+  }
+  return envelope_t{.attack = env.attack,
+                    .decay = env.decay,
+                    .sustain = env.sustain,
+                    .release = env.release};
+}
+
+static image_command flatten(song_tick_t tick, const command &held) {
+  auto out = image_command{.tick = tick, .type = type_of(held)};
+  std::visit(
+      [&out](auto &&c) {
+        using C = std::decay_t<decltype(c)>;
+        if constexpr (std::is_same_v<C, command_note_on>) {
+          out.channel = c.channel;
+          out.a = c.note;
+          out.b = c.velocity;
+        } else if constexpr (std::is_same_v<C, command_note_off>) {
+          out.channel = c.channel;
+        } else if constexpr (std::is_same_v<C, command_pitchwheel>) {
+          out.channel = c.channel;
+          out.value = c.bend;
+        } else if constexpr (std::is_same_v<C, command_program_change>) {
+          out.channel = c.channel;
+          out.a = c.program;
+        } else if constexpr (std::is_same_v<C, command_version>) {
+          out.value = c.song_version;
+        } else if constexpr (std::is_same_v<C, command_rate>) {
+          out.value = static_cast<S32>(c.song_rate);
+        }
+      },
+      held);
+  return out;
+}
+
+static command expand(const image_command &c) {
+  switch (c.type) {
+  case command_type::note_on: {
+    return command_note_on{
+        .channel = c.channel, .note = c.a, .velocity = c.b};
+  }
+  case command_type::note_off: {
+    return command_note_off{.channel = c.channel};
+  }
+  case command_type::pitchwheel: {
+    return command_pitchwheel{.channel = c.channel, .bend = c.value};
+  }
+  case command_type::program_change: {
+    return command_program_change{.channel = c.channel, .program = c.a};
+  }
+  case command_type::patch_data: {
+    return command_patch_data{};
+  }
+  case command_type::drum_data: {
+    return command_drum_data{};
+  }
+  case command_type::version: {
+    return command_version{.song_version = static_cast<U16>(c.value)};
+  }
+  case command_type::rate: {
+    return command_rate{.song_rate = static_cast<U32>(c.value)};
+  }
+  case command_type::end_of_track: {
+    return command_end_of_track{};
+  }
+  }
+  fail<std::runtime_error>("Compiled song image holds an unknown command");
+}
+
+std::vector<U8> song::compile(U64 hash) const {
+  check_host();
+  auto waveforms = std::vector<U8>{};
+  auto mips = std::vector<U8>{};
+
+  auto patch_table = std::vector<image_patch>{};
+  for (auto &&[id, patch] : patches) {
+    // an image carries every level, lazily loaded or not
+    patch.materialize();
+    auto &&levels = patch.mips();
+    auto record = image_patch{
+        .id = id,
+        .mip_count = static_cast<U8>(levels.size()),
+        .loop_start = patch.loop_start,
+        .loop_end = patch.loop_end,
+        .ratio = patch.ratio,
+        .gain_L = patch.gain_L,
+        .gain_R = patch.gain_R,
+        .envelope = envelope_of(patch),
+        .waveform_at = static_cast<U32>(waveforms.size()),
+        .waveform_size = static_cast<U32>(patch.waveform.size()),
+        .mip_at = static_cast<U32>(mips.size())};
+    waveforms.insert(waveforms.end(), patch.waveform.begin(),
+                     patch.waveform.end());
+    for (auto &&level : levels) {
+      const auto at = mips.size();
+      mips.resize(at + (level.size() * sizeof(F32)));
+      std::memcpy(mips.data() + at, level.data(), level.size() * sizeof(F32));
+    }
+    patch_table.emplace_back(record);
+  }
+  auto drum_table = std::vector<image_drum>{};
+  for (auto &&[id, drum] : drums) {
+    drum_table.emplace_back(
+        image_drum{.id = id,
+                   .ratio = drum.ratio,
+                   .gain_L = drum.gain_L,
+                   .gain_R = drum.gain_R,
+                   .envelope = envelope_of(drum),
+                   .waveform_at = static_cast<U32>(waveforms.size()),
+                   .waveform_size = static_cast<U32>(drum.waveform.size())});
+    waveforms.insert(waveforms.end(), drum.waveform.begin(),
+                     drum.waveform.end());
+  }
+
+  auto header = image_header{.magic = IMAGE_MAGIC,
+                             .image_version = IMAGE_VERSION,
+                             .song_version = version,
+                             .ticks_end = ticks_end,
+                             .ticks_per_second = ticks_per_second,
+                             .source_hash = hash,
+                             .command_count =
+                                 static_cast<U32>(commands.size()),
+                             .patch_count = static_cast<U32>(patches.size()),
+                             .drum_count = static_cast<U32>(drums.size())};
+  auto bytes = std::vector<U8>(sizeof(image_header));
+
+  header.commands_at = static_cast<U32>(bytes.size());
+  for (auto &&[tick, held] : commands) {
+    put_record(bytes, flatten(tick, held));
+  }
+  header.patches_at = static_cast<U32>(bytes.size());
+  for (auto &&p : patch_table) {
+    put_record(bytes, p);
+  }
+  header.drums_at = static_cast<U32>(bytes.size());
+  for (auto &&d : drum_table) {
+    put_record(bytes, d);
+  }
+  header.waveforms_at = static_cast<U32>(bytes.size());
+  bytes.insert(bytes.end(), waveforms.begin(), waveforms.end());
+  // keep the F32 pool aligned for anyone reading the image in place
+  bytes.resize((bytes.size() + alignof(F32) - 1) & ~(alignof(F32) - 1));
+  header.mips_at = static_cast<U32>(bytes.size());
+  bytes.insert(bytes.end(), mips.begin(), mips.end());
+
+  header.size = bytes.size();
+  header.checksum =
+      image_checksum(std::span<const U8>{bytes}.subspan(sizeof(image_header)));
+  std::memcpy(bytes.data(), &header, sizeof(image_header));
+  return bytes;
+}
+
+song song::load_compiled(std::span<const U8> image,
+                         std::optional<U64> expected_hash) {
+  return load_compiled(image, compiled_options{.source_hash = expected_hash});
+}
+
+song song::load_compiled(std::span<const U8> image,
+                         const compiled_options &options) {
+  check_host();
+  const auto header = get_record<image_header>(image, 0, TRUNCATED);
+  if (header.magic != IMAGE_MAGIC) {
+    fail<std::runtime_error>("First 4 bytes of this image are not 'AXSC'!");
+  }
+  if (header.image_version != IMAGE_VERSION) {
+    fail<std::runtime_error>("Version mismatch in compiled song image");
+  }
+  if (header.size != image.size()) {
+    fail<std::runtime_error>(TRUNCATED);
+  }
+  const auto body = image.subspan(sizeof(image_header));
+  if ((!options.checked) && (header.checksum != image_checksum(body))) {
+    fail<std::runtime_error>("Compiled song image fails its checksum");
+  }
+  if (options.source_hash.has_value() &&
+      (header.source_hash != options.source_hash.value())) {
+    fail<std::runtime_error>("Compiled song image is out of date");
+  }
+
+  auto the_song = song{.version = header.song_version,
+                       .ticks_end = header.ticks_end,
+                       .ticks_per_second = header.ticks_per_second};
+
+  // a pool slice that has to lie inside the image
+  auto slice = [&image](std::size_t at, std::size_t size) {
+    if ((at > image.size()) || (image.size() - at < size)) {
+      fail<std::runtime_error>(TRUNCATED);
+    }
+    return image.subspan(at, size);
+  };
+  // waveforms stay in the image while something keeps it alive
+  auto waveform_at = [&options, &slice](std::size_t at, std::size_t size) {
+    const auto bytes = slice(at, size);
+    if (options.storage) {
+      return waveform_t{.bytes = bytes, .owner = options.storage};
+    }
+    return waveform_t::own(patch_data_t(bytes.begin(), bytes.end()));
+  };
+
+  const auto command_table = get_table<image_command>(
+      image, header.commands_at, header.command_count);
+  the_song.commands.reserve(command_table.size());
+  for (auto &&c : command_table) {
+    the_song.commands.emplace_back(c.tick, expand(c));
+  }
+
+  for (auto &&p : get_table<image_patch>(image, header.patches_at,
+                                         header.patch_count)) {
+    auto patch = patch_t{};
+    patch.waveform = waveform_at(
+        std::size_t{header.waveforms_at} + p.waveform_at, p.waveform_size);
+    patch.ratio = p.ratio;
+    patch.gain_L = p.gain_L;
+    patch.gain_R = p.gain_R;
+    patch.envelope = envelope_from(p.envelope);
+    patch.loop_start = p.loop_start;
+    patch.loop_end = p.loop_end;
+    const auto level_bytes = std::size_t{p.waveform_size} * sizeof(F32);
+    for (auto m = U8{0}; m < p.mip_count; m++) {
+      const auto level = slice(std::size_t{header.mips_at} + p.mip_at +
+                                   (m * level_bytes),
+                               level_bytes);
+      auto &&values = patch.mip_levels.emplace_back(p.waveform_size);
+      std::memcpy(values.data(), level.data(), level_bytes);
+    }
+    the_song.patches.insert({p.id, std::move(patch)});
+  }
+
+  for (auto &&d :
+       get_table<image_drum>(image, header.drums_at, header.drum_count)) {
+    auto drum = drum_t{};
+    drum.waveform = waveform_at(
+        std::size_t{header.waveforms_at} + d.waveform_at, d.waveform_size);
+    drum.ratio = d.ratio;
+    drum.gain_L = d.gain_L;
+    drum.gain_R = d.gain_R;
+    drum.envelope = envelope_from(d.envelope);
+    the_song.drums.insert({d.id, std::move(drum)});
+  }
+  return the_song;
+}
@@ -0,0 +1,137 @@
+// ============================================================================
+//   Copyright 2023 Roland Metivier <metivier.roland@chlorophyt.us>
+//
+//   Licensed under the Apache License, Version 2.0 (the "License");
+//   you may not use this file except in compliance with the License.
+//   You may obtain a copy of the License at
+//
+//       http://www.apache.org/licenses/LICENSE-2.0
+//
+//   Unless required by applicable law or agreed to in writing, software
+//   distributed under the License is distributed on an "AS IS" BASIS,
+//   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+//   See the License for the specific language governing permissions and
+//   limitations under the License.
+// ============================================================================
+//   AxolotlSD for C++ synthetic song generator
+#include "axolotlsd_writer.hpp"
+#include <algorithm>
+#include <bit>
+
+using namespace axolotlsd;
+
+constexpr static U8 DRUM_CHANNEL = 9;
+constexpr static U8 FIRST_DRUM = 35;
+
+// xorshift32, kept local so the output never depends on the library's
+// random state
+struct generator_random {
+  U32 state;
+
+  U32 next() {
+    state ^= state << 13;
+    state ^= state >> 17;
+    state ^= state << 5;
+    return state;
+  }
+  U32 below(U32 most) { return next() % most; }
+};
+
+// A few triangle cycles with some noise on top, all in integers so the
+// bytes never depend on the platform's libm. Short drums ask for no cycles
+// at all, they get one.
+static void write_waveform(writer &w, generator_random &random, U32 size,
+                           U32 cycles) {
+  const auto period = std::max(size / std::max(cycles, U32{1}), U32{4});
+  for (auto i = U32{0}; i < size; i++) {
+    const auto phase = static_cast<S32>(((i % period) * 512) / period);
+    const auto triangle = (phase < 256) ? phase : 511 - phase;
+    const auto noise = static_cast<S32>(random.below(17)) - 8;
+    w.u8(static_cast<U8>(std::clamp(triangle + noise, 0, 255)));
+  }
+}
+
+std::vector<U8> axolotlsd::generate_song(const generator_options &options) {
+  auto bytes = std::vector<U8>{'A', 'X', 'S', 'D'};
+  auto w = writer{bytes};
+  auto random = generator_random{(options.seed == 0) ? 1 : options.seed};
+
+  // melodic channels in order, stepping over the drum channel
+  auto melodic = std::vector<U8>{};
+  for (auto c = U8{0}; (c < 16) && (melodic.size() < options.channels);
+       c++) {
+    if (c != DRUM_CHANNEL) {
+      melodic.emplace_back(c);
+    }
+  }
+  const auto size = std::max(options.patch_size, U32{1});
+  const auto drums = std::min<U32>(options.drums, 128 - FIRST_DRUM);
+
+  w.u8(static_cast<U8>(command_type::version));
+  w.u16(0x0003);
+  w.u8(static_cast<U8>(command_type::rate));
+  w.u32(options.ticks_per_second);
+
+  for (auto &&c : melodic) {
+    w.u8(static_cast<U8>(command_type::patch_data));
+    w.u8(c);
+    w.u32(size);
+    w.u32(options.looping ? 0 : 0xFFFFFFFF);
+    w.u32(size - 1);
+    w.f32(1.0f);
+    w.f32(1.0f - (c / 32.0f));
+    w.f32(0.5f + (c / 32.0f));
+    write_waveform(w, random, size, c + 1);
+  }
+  for (auto d = U32{0}; d < drums; d++) {
+    w.u8(static_cast<U8>(command_type::drum_data));
+    w.u8(FIRST_DRUM + d);
+    w.u32(size);
+    w.f32(1.0f);
+    w.f32(0.75f);
+    w.f32(0.75f);
+    write_waveform(w, random, size, (size / 8) + d);
+  }
+
+  for (auto &&c : melodic) {
+    w.timed(command_type::program_change, 0, c);
+    w.u8(c);
+  }
+
+  const auto held = melodic.empty() ? 0 : options.voices;
+  for (auto s = U32{0}; s < options.steps; s++) {
+    const auto start = s * options.step_ticks;
+
+    // the last step's chord goes before this one starts
+    for (auto v = U32{0}; (s > 0) && (v < held); v++) {
+      w.timed(command_type::note_off, start, melodic[v % melodic.size()]);
+    }
+    for (auto v = U32{0}; v < held; v++) {
+      w.timed(command_type::note_on, start, melodic[v % melodic.size()]);
+      w.u8(36 + random.below(48));
+      w.u8(64 + random.below(64));
+    }
+    for (auto d = U32{0}; d < drums; d++) {
+      w.timed(command_type::note_on, start, DRUM_CHANNEL);
+      w.u8(FIRST_DRUM + d);
+      w.u8(64 + random.below(64));
+    }
+    // tick by tick, so the stream is already in song::save order
+    for (auto k = U32{0}; k < options.pitchwheel; k++) {
+      for (auto &&c : melodic) {
+        w.timed(command_type::pitchwheel,
+                start + ((k * options.step_ticks) / options.pitchwheel), c);
+        w.u32(std::bit_cast<U32>(static_cast<S32>(random.below(16385)) -
+                                 8192));
+      }
+    }
+  }
+
+  const auto last = options.steps * options.step_ticks;
+  for (auto v = U32{0}; (options.steps > 0) && (v < held); v++) {
+    w.timed(command_type::note_off, last, melodic[v % melodic.size()]);
+  }
+  w.u8(static_cast<U8>(command_type::end_of_track));
+  w.u32(last + 1);
+  return bytes;
+}
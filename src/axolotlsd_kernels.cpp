@@ -0,0 +1,132 @@
+// ============================================================================
+//   Copyright 2023 Roland Metivier <metivier.roland@chlorophyt.us>
+//
+//   Licensed under the Apache License, Version 2.0 (the "License");
+//   you may not use this file except in compliance with the License.
+//   You may obtain a copy of the License at
+//
+//       http://www.apache.org/licenses/LICENSE-2.0
+//
+//   Unless required by applicable law or agreed to in writing, software
+//   distributed under the License is distributed on an "AS IS" BASIS,
+//   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+//   See the License for the specific language governing permissions and
+//   limitations under the License.
+// ============================================================================
+//   AxolotlSD for C++ render kernels and their runtime dispatch
+#include "axolotlsd_kernels.hpp"
+#include <cstdlib>
+#include <string_view>
+
+using namespace axolotlsd;
+
+#define AXOLOTLSD_KERNEL_NAME baseline_kernels
+#define AXOLOTLSD_KERNEL_ISA cpu_isa::baseline
+#define AXOLOTLSD_KERNEL_TARGET
+#include "axolotlsd_kernels.inl"
+#undef AXOLOTLSD_KERNEL_NAME
+#undef AXOLOTLSD_KERNEL_ISA
+#undef AXOLOTLSD_KERNEL_TARGET
+
+// Wider variants need GCC or Clang function targets on an x86 build
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#define AXOLOTLSD_X86_KERNELS 1
+
+#define AXOLOTLSD_KERNEL_NAME avx2_kernels
+#define AXOLOTLSD_KERNEL_ISA cpu_isa::avx2
+#define AXOLOTLSD_KERNEL_TARGET [[gnu::target("avx2,fma")]]
+#include "axolotlsd_kernels.inl"
+#undef AXOLOTLSD_KERNEL_NAME
+#undef AXOLOTLSD_KERNEL_ISA
+#undef AXOLOTLSD_KERNEL_TARGET
+
+#define AXOLOTLSD_KERNEL_NAME avx512_kernels
+#define AXOLOTLSD_KERNEL_ISA cpu_isa::avx512
+#define AXOLOTLSD_KERNEL_TARGET                                               \
+  [[gnu::target("avx512f,avx512bw,avx512vl,avx2,fma")]]
+#include "axolotlsd_kernels.inl"
+#undef AXOLOTLSD_KERNEL_NAME
+#undef AXOLOTLSD_KERNEL_ISA
+#undef AXOLOTLSD_KERNEL_TARGET
+#endif
+
+static cpu_isa detect() {
+#ifdef AXOLOTLSD_X86_KERNELS
+  __builtin_cpu_init();
+  if (__builtin_cpu_supports("avx512f") && __builtin_cpu_supports("avx512bw") &&
+      __builtin_cpu_supports("avx512vl")) {
+    return cpu_isa::avx512;
+  }
+  if (__builtin_cpu_supports("avx2") && __builtin_cpu_supports("fma")) {
+    return cpu_isa::avx2;
+  }
+#endif
+  return cpu_isa::baseline;
+}
+
+template <typename T> static const kernels::table<T> &table_for(cpu_isa isa) {
+  switch (isa) {
+#ifdef AXOLOTLSD_X86_KERNELS
+  case cpu_isa::avx512: {
+    return avx512_kernels::variant<T>;
+  }
+  case cpu_isa::avx2: {
+    return avx2_kernels::variant<T>;
+  }
+#endif
+  default: {
+    return baseline_kernels::variant<T>;
+  }
+  }
+}
+
+// AXOLOTLSD_ISA asks for an older set than the CPU has, unknown names are
+// ignored
+static cpu_isa from_environment(cpu_isa isa) {
+  const auto wanted = std::getenv("AXOLOTLSD_ISA");
+  if (wanted == nullptr) {
+    return isa;
+  }
+  const auto name = std::string_view{wanted};
+  if (name == "baseline") {
+    return cpu_isa::baseline;
+  } else if (name == "avx2") {
+    return std::min(cpu_isa::avx2, isa);
+  } else if (name == "avx512") {
+    return std::min(cpu_isa::avx512, isa);
+  }
+  return isa;
+}
+
+// One choice covers every sample type, -1 until the first lookup
+static std::atomic<S32> selected{-1};
+
+static cpu_isa selected_isa() {
+  auto isa = selected.load(std::memory_order_acquire);
+  if (isa < 0) {
+    // racing first calls all work out the same set
+    isa = static_cast<S32>(from_environment(detected_isa()));
+    selected.store(isa, std::memory_order_release);
+  }
+  return static_cast<cpu_isa>(isa);
+}
+
+template <typename T> const kernels::table<T> &kernels::active() {
+  return table_for<T>(selected_isa());
+}
+template const kernels::table<F32> &kernels::active();
+template const kernels::table<F64> &kernels::active();
+template const kernels::table<fixed_t> &kernels::active();
+
+cpu_isa axolotlsd::detected_isa() {
+  const static auto isa = detect();
+  return isa;
+}
+
+cpu_isa axolotlsd::active_isa() { return selected_isa(); }
+
+cpu_isa axolotlsd::force_isa(cpu_isa wanted) {
+  const auto isa = std::min(wanted, detected_isa());
+  selected.store(static_cast<S32>(isa), std::memory_order_release);
+  return isa;
+}
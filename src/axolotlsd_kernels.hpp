@@ -0,0 +1,290 @@
+// ============================================================================
+//   Copyright 2023 Roland Metivier <metivier.roland@chlorophyt.us>
+//
+//   Licensed under the Apache License, Version 2.0 (the "License");
+//   you may not use this file except in compliance with the License.
+//   You may obtain a copy of the License at
+//
+//       http://www.apache.org/licenses/LICENSE-2.0
+//
+//   Unless required by applicable law or agreed to in writing, software
+//   distributed under the License is distributed on an "AS IS" BASIS,
+//   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+//   See the License for the specific language governing permissions and
+//   limitations under the License.
+// ============================================================================
+//   AxolotlSD for C++ render kernels, private to the library
+#pragma once
+#include "../include/axolotlsd.hpp"
+#include <algorithm>
+#include <cmath>
+#include <numbers>
+#include <type_traits>
+
+namespace axolotlsd::kernels {
+constexpr auto SINC_TAPS = 8;
+constexpr auto SINC_PHASES = 256;
+
+// Power series for the few transcendental functions the tables need. They
+// only run at compile time, where every step is correctly rounded, so the
+// tables come out the same on any compiler, libm or instruction set.
+constexpr F64 series_sin_pi(F64 x) {
+  // sin(pi * x), reduced to [-1, 1] first
+  const auto half = x / 2.0;
+  const auto periods = static_cast<S64>(half + ((half < 0.0) ? -0.5 : 0.5));
+  const auto y = std::numbers::pi * (x - (2.0 * periods));
+  auto term = y;
+  auto sum = y;
+  for (auto k = 1; k < 32; k++) {
+    term *= -(y * y) / ((2.0 * k) * ((2.0 * k) + 1.0));
+    sum += term;
+  }
+  return sum;
+}
+constexpr F64 series_cos_pi(F64 x) { return series_sin_pi(x + 0.5); }
+constexpr F64 series_exp2(F64 x) {
+  // 2^x for x in [0, 1)
+  const auto y = x * std::numbers::ln2;
+  auto term = 1.0;
+  auto sum = 1.0;
+  for (auto k = 1; k < 32; k++) {
+    term *= y / k;
+    sum += term;
+  }
+  return sum;
+}
+
+// Blackman windowed sinc, one row of taps per fractional phase
+template <typename T>
+inline constexpr auto sinc_table = [] {
+  auto table = std::array<std::array<T, SINC_TAPS>, SINC_PHASES>{};
+  for (auto p = 0; p < SINC_PHASES; p++) {
+    const auto frac = static_cast<F64>(p) / SINC_PHASES;
+    auto sum = 0.0;
+    auto row = std::array<F64, SINC_TAPS>{};
+    for (auto t = 0; t < SINC_TAPS; t++) {
+      const auto x = t - (SINC_TAPS / 2 - 1) - frac;
+      const auto sinc =
+          (x == 0.0) ? 1.0 : series_sin_pi(x) / (std::numbers::pi * x);
+      const auto w = (x + SINC_TAPS / 2) / SINC_TAPS;
+      const auto window = 0.42 - 0.5 * series_cos_pi(2.0 * w) +
+                          0.08 * series_cos_pi(4.0 * w);
+      row[t] = sinc * window;
+      sum += row[t];
+    }
+    for (auto t = 0; t < SINC_TAPS; t++) {
+      table[p][t] = static_cast<T>(row[t] / sum);
+    }
+  }
+  return table;
+}();
+
+template <typename T> inline T normalize(U8 sample) {
+  if constexpr (std::is_same_v<T, fixed_t>) {
+    return fixed_t::from_raw((S32{sample} - 128) * (fixed_t::ONE / 128));
+  } else {
+    return (static_cast<T>(sample) - 128) / 128;
+  }
+}
+template <typename T> inline T normalize(F32 sample) {
+  return static_cast<T>(sample);
+}
+
+// Folds a stereo pair of coefficients down to the wanted channel layout
+template <channel_layout L> inline frame_t<L> spread(F32 l, F32 r) {
+  if constexpr (L == channel_layout::stereo) {
+    return {l, r};
+  } else {
+    return {(l + r) / 2.0f};
+  }
+}
+
+// Converts control rate coefficients to the sample type once per run
+template <typename T, std::size_t N>
+inline std::array<T, N> to_samples(const std::array<F32, N> &in) {
+  auto out = std::array<T, N>{};
+  for (auto i = std::size_t{0}; i < N; i++) {
+    out[i] = static_cast<T>(in[i]);
+  }
+  return out;
+}
+
+template <typename T> inline T calculate_mix(T x, T y, T a) {
+  return (x * (static_cast<T>(1) - a)) + (y * a);
+}
+
+// xorshift32, returns a uniform value in [-0.5, 0.5)
+inline F32 next_uniform(U32 &state) {
+  state ^= state << 13;
+  state ^= state >> 17;
+  state ^= state << 5;
+  return (state / 4294967296.0f) - 0.5f;
+}
+
+// How far before and after the read position each kernel looks
+template <interpolation I> constexpr std::array<S64, 2> reach() {
+  if constexpr (I == interpolation::none) {
+    return {0, 0};
+  } else if constexpr (I == interpolation::linear) {
+    return {0, 1};
+  } else if constexpr (I == interpolation::cubic) {
+    return {1, 2};
+  } else {
+    return {SINC_TAPS / 2 - 1, SINC_TAPS / 2};
+  }
+}
+
+// A read position with 32 fractional bits, fixed_t runs step these so their
+// inner loop stays in integers
+inline S64 to_phase(F32 x) {
+  return static_cast<S64>(std::ldexp(static_cast<F64>(x), 32));
+}
+
+// The sinc row for a fraction in [0, 1)
+inline U32 sinc_row(F32 frac) { return static_cast<U32>(frac * SINC_PHASES); }
+inline U32 sinc_row(fixed_t frac) {
+  return static_cast<U32>(frac.raw) / (fixed_t::ONE / SINC_PHASES);
+}
+
+// Reads a waveform at a fractional position, tap() maps whole indices onto
+// the waveform (looping, silence past either end) and returns samples. The
+// fraction is an F32, or a fixed_t for fixed_t samples.
+template <interpolation I, typename P, typename F>
+inline auto interpolate(P &&tap, S64 here, F frac) {
+  using T = decltype(tap(here));
+  const auto t = static_cast<T>(frac);
+  if constexpr (I == interpolation::none) {
+    return tap(here);
+  } else if constexpr (I == interpolation::linear) {
+    const auto x0 = tap(here);
+    return x0 + (tap(here + 1) - x0) * t;
+  } else if constexpr (I == interpolation::cubic) {
+    // Catmull-Rom flavoured Hermite
+    constexpr auto half = static_cast<T>(0.5f);
+    constexpr auto one_half = static_cast<T>(1.5f);
+    constexpr auto two = static_cast<T>(2.0f);
+    constexpr auto two_half = static_cast<T>(2.5f);
+    const auto xm1 = tap(here - 1);
+    const auto x0 = tap(here);
+    const auto x1 = tap(here + 1);
+    const auto x2 = tap(here + 2);
+    const auto c1 = half * (x1 - xm1);
+    const auto c2 = xm1 - two_half * x0 + two * x1 - half * x2;
+    const auto c3 = half * (x2 - xm1) + one_half * (x0 - x1);
+    return ((c3 * t + c2) * t + c1) * t + x0;
+  } else {
+    auto &&row = sinc_table<T>[sinc_row(frac)];
+    auto sum = T{};
+    for (auto k = 0; k < SINC_TAPS; k++) {
+      sum += tap(here + k - (SINC_TAPS / 2 - 1)) * row[k];
+    }
+    return sum;
+  }
+}
+
+// The inner loop of every voice: a straight run of frames that cannot cross
+// a loop point or the end of the sample, so it carries no control flow
+template <channel_layout L, interpolation I, typename T, typename P>
+inline void render_run(P &&tap, F32 position, F32 step,
+                       const frame_t<L, T> &gain, T level, T slope, T *mix,
+                       S64 frames) {
+  constexpr auto N = static_cast<S64>(L);
+  auto put = [&gain, mix](S64 f, T sample) {
+    for (auto c = 0; c < N; c++) {
+      mix[(f * N) + c] += sample * gain[c];
+    }
+  };
+  if constexpr (std::is_same_v<T, fixed_t>) {
+    auto phase = to_phase(position);
+    const auto advance = to_phase(step);
+    for (auto f = 0; f < frames; f++) {
+      // the top 16 of the 32 fractional bits are a Q16 fraction
+      const auto frac = fixed_t::from_raw(static_cast<S32>(
+          (static_cast<U64>(phase) >> 16) & (fixed_t::ONE - 1)));
+      put(f, interpolate<I>(tap, phase >> 32, frac) *
+                 (level + (static_cast<T>(f) * slope)));
+      phase += advance;
+    }
+  } else {
+    for (auto f = 0; f < frames; f++) {
+      const auto at = position + (f * step);
+      const auto whole = std::floor(at);
+      put(f, interpolate<I>(tap, static_cast<S64>(whole), at - whole) *
+                 (level + (static_cast<T>(f) * slope)));
+    }
+  }
+}
+
+// Frames the kernels' staged run works through at once, its arrays stay on
+// the stack
+constexpr auto RUN_CHUNK = S64{64};
+
+// The first and last whole index render_run reads before interpolation
+template <typename T>
+inline std::array<S64, 2> run_extent(F32 position, F32 step, S64 frames) {
+  if constexpr (std::is_same_v<T, fixed_t>) {
+    const auto phase = to_phase(position);
+    return {phase >> 32, (phase + ((frames - 1) * to_phase(step))) >> 32};
+  } else {
+    return {static_cast<S64>(std::floor(position)),
+            static_cast<S64>(std::floor(position + ((frames - 1) * step)))};
+  }
+}
+// ============================================================================
+// A voice run whose every read lands inside source, gain past the layout's
+// channel count is ignored
+template <typename S, typename T> struct run_args {
+  const S *source;
+  F32 position;
+  F32 step;
+  std::array<T, 2> gain;
+  T level;
+  T slope;
+  T *mix;
+  S64 frames;
+};
+// An echo line pair as the echo kernel walks it
+template <typename T> struct echo_state {
+  std::array<T *, 2> buffers;
+  U16 cursor;
+  U16 cursor_max;
+  std::array<T, 2> feedback;
+  std::array<T, 2> wet;
+  bool filtered;
+  std::array<T, 8> fir;
+};
+template <typename S, typename T>
+using run_fn = void (*)(const run_args<S, T> &);
+template <typename T> using sfx_fn = void (*)(sfx &, T *, U32);
+template <typename T> using echo_fn = void (*)(echo_state<T> &, T *, U32);
+
+// Every hot loop built for one instruction set and sample type, per layout
+// entries are indexed by channel count - 1 and run entries then by
+// interpolation
+template <typename T> struct table {
+  cpu_isa isa;
+  std::array<std::array<run_fn<U8, T>, 4>, 2> run_u8;
+  std::array<std::array<run_fn<F32, T>, 4>, 2> run_f32;
+  std::array<sfx_fn<T>, 2> mix_sfx;
+  std::array<echo_fn<T>, 2> echo;
+  void (*scale)(T *, std::size_t, T);
+  void (*clamp)(T *, std::size_t);
+  void (*to_f32)(const T *, F32 *, std::size_t);
+  // dither state is null for plain rounding
+  void (*to_s16)(const T *, S16 *, std::size_t, U32 *);
+
+  template <typename S>
+  run_fn<S, T> run(channel_layout layout, interpolation quality) const {
+    const auto c = static_cast<std::size_t>(layout) - 1;
+    const auto q = static_cast<std::size_t>(quality);
+    if constexpr (std::is_same_v<S, U8>) {
+      return run_u8[c][q];
+    } else {
+      return run_f32[c][q];
+    }
+  }
+};
+
+// The table picked for this process, see force_isa()
+template <typename T> const table<T> &active();
+} // namespace axolotlsd::kernels
@@ -0,0 +1,229 @@
+// ============================================================================
+//   Copyright 2023 Roland Metivier <metivier.roland@chlorophyt.us>
+//
+//   Licensed under the Apache License, Version 2.0 (the "License");
+//   you may not use this file except in compliance with the License.
+//   You may obtain a copy of the License at
+//
+//       http://www.apache.org/licenses/LICENSE-2.0
+//
+//   Unless required by applicable law or agreed to in writing, software
+//   distributed under the License is distributed on an "AS IS" BASIS,
+//   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+//   See the License for the specific language governing permissions and
+//   limitations under the License.
+// ============================================================================
+//   AxolotlSD for C++ render kernels for one instruction set. Included once
+//   per variant by axolotlsd_kernels.cpp with AXOLOTLSD_KERNEL_NAME (the
+//   namespace), AXOLOTLSD_KERNEL_ISA and AXOLOTLSD_KERNEL_TARGET (a function
+//   attribute, or nothing for the baseline) defined. Everything here carries
+//   the target, the small shared inline bodies are compiled into it, and a
+//   body too big to inline belongs here rather than in the header.
+namespace AXOLOTLSD_KERNEL_NAME {
+using namespace axolotlsd;
+using namespace axolotlsd::kernels;
+
+// render_run for reads straight from source, split into one loop per stage
+// (positions, taps, interpolation, mixing) over a chunk of frames so all but
+// the tap loads vectorize. Every frame goes through the same operations in the
+// same order as in render_run, so the samples are bit-identical.
+template <channel_layout L, interpolation I, typename S, typename T>
+AXOLOTLSD_KERNEL_TARGET static void
+render_run_staged(const S *source, F32 position, F32 step,
+                  const frame_t<L, T> &gain, T level, T slope, T *mix,
+                  S64 frames) {
+  constexpr auto N = static_cast<S64>(L);
+  constexpr auto BEFORE = reach<I>()[0];
+  constexpr auto TAPS = BEFORE + reach<I>()[1] + 1;
+  for (auto from = S64{0}; from < frames; from += RUN_CHUNK) {
+    const auto count = std::min(RUN_CHUNK, frames - from);
+    S32 here[RUN_CHUNK];
+    F32 frac[RUN_CHUNK];
+    T taps[TAPS][RUN_CHUNK];
+    T samples[RUN_CHUNK];
+
+    for (auto i = S64{0}; i < count; i++) {
+      const auto at = position + (static_cast<S32>(from + i) * step);
+      const auto whole = std::floor(at);
+      here[i] = static_cast<S32>(whole);
+      frac[i] = at - whole;
+    }
+    for (auto k = S64{0}; k < TAPS; k++) {
+      for (auto i = S64{0}; i < count; i++) {
+        taps[k][i] = normalize<T>(source[here[i] + k - BEFORE]);
+      }
+    }
+    for (auto i = S64{0}; i < count; i++) {
+      auto tap = [&taps, i](S64 k) { return taps[k + BEFORE][i]; };
+      samples[i] = interpolate<I>(tap, 0, frac[i]) *
+                   (level + (static_cast<T>(static_cast<S32>(from + i)) *
+                             slope));
+    }
+    for (auto i = S64{0}; i < count; i++) {
+      for (auto c = S64{0}; c < N; c++) {
+        mix[((from + i) * N) + c] += samples[i] * gain[c];
+      }
+    }
+  }
+}
+
+template <channel_layout L, interpolation I, typename S, typename T>
+AXOLOTLSD_KERNEL_TARGET static void run(const run_args<S, T> &args) {
+  auto gain = frame_t<L, T>{};
+  std::copy_n(args.gain.begin(), gain.size(), gain.begin());
+  if constexpr (std::is_floating_point_v<T>) {
+    render_run_staged<L, I>(args.source, args.position, args.step, gain,
+                            args.level, args.slope, args.mix, args.frames);
+  } else {
+    // fixed_t steps an integer phase, see render_run
+    auto tap = [source = args.source](S64 k) {
+      return normalize<T>(source[k]);
+    };
+    render_run<L, I>(tap, args.position, args.step, gain, args.level,
+                     args.slope, args.mix, args.frames);
+  }
+}
+
+template <channel_layout L, typename T>
+AXOLOTLSD_KERNEL_TARGET static void mix_sfx(sfx &s, T *mix, U32 frames) {
+  constexpr auto N = static_cast<U32>(L);
+  const auto pan = to_samples<T>(spread<L>(s.pan_L, s.pan_R));
+  for (auto f = U32{0}; (f < frames) && (!s.finished()); f++) {
+    s.accumulator -= s.pitch;
+    const auto sfx_byte = static_cast<T>(S16{s.data[s.position]} - 127) /
+                          static_cast<T>(128);
+    for (auto c = U32{0}; c < N; c++) {
+      mix[(f * N) + c] += sfx_byte * pan[c];
+    }
+    s.position++;
+    while ((s.accumulator < 1.0f) && (!s.finished())) {
+      s.position++;
+      s.accumulator += 1.0f;
+    }
+  }
+}
+
+template <channel_layout L, typename T>
+AXOLOTLSD_KERNEL_TARGET static void echo(echo_state<T> &e, T *mix,
+                                         U32 frames) {
+  constexpr auto N = static_cast<U32>(L);
+  for (auto f = U32{0}; f < frames; f++) {
+    for (auto c = U32{0}; c < N; c++) {
+      auto &&buffer = e.buffers[c];
+      auto &&out = mix[(f * N) + c];
+      buffer[e.cursor] += out;
+
+      if (e.filtered) {
+        auto taps = decltype(e.fir){};
+        constexpr auto last = S32{taps.size() - 1};
+        if (e.cursor >= last) {
+          // a straight window ending at the cursor, multiplied in one go
+          const auto *window = buffer + (e.cursor - last);
+          for (auto t = 0; t <= last; t++) {
+            taps[t] = window[last - t] * e.fir[t];
+          }
+        } else {
+          for (auto t = 0; t <= last; t++) {
+            // taps reach back past the start of the line into its end
+            auto at = (S32{e.cursor} - t) % e.cursor_max;
+            if (at < 0) {
+              at += e.cursor_max;
+            }
+            taps[t] = buffer[at] * e.fir[t];
+          }
+        }
+        // summed in tap order, as deterministic renders expect
+        auto fir_sum = T{};
+        for (auto &&tap : taps) {
+          fir_sum += tap;
+        }
+        buffer[e.cursor] += fir_sum / static_cast<T>(64);
+      }
+
+      buffer[e.cursor] *= e.feedback[c];
+
+      // protect against clipping
+      buffer[e.cursor] = std::clamp(buffer[e.cursor], static_cast<T>(-1),
+                                    static_cast<T>(1));
+
+      out = calculate_mix(out, buffer[e.cursor], e.wet[c]);
+    }
+    e.cursor = (e.cursor + 1) % e.cursor_max;
+  }
+}
+
+template <typename T>
+AXOLOTLSD_KERNEL_TARGET static void scale(T *mix, std::size_t count, T by) {
+  for (auto i = std::size_t{0}; i < count; i++) {
+    mix[i] *= by;
+  }
+}
+
+template <typename T>
+AXOLOTLSD_KERNEL_TARGET static void clamp(T *mix, std::size_t count) {
+  for (auto i = std::size_t{0}; i < count; i++) {
+    mix[i] = std::clamp(mix[i], static_cast<T>(-1), static_cast<T>(1));
+  }
+}
+
+template <typename T>
+AXOLOTLSD_KERNEL_TARGET static void to_f32(const T *in, F32 *out,
+                                           std::size_t count) {
+  for (auto i = std::size_t{0}; i < count; i++) {
+    out[i] = static_cast<F32>(
+        std::clamp(in[i], static_cast<T>(-1), static_cast<T>(1)));
+  }
+}
+
+template <typename T>
+AXOLOTLSD_KERNEL_TARGET static void to_s16(const T *in, S16 *out,
+                                           std::size_t count, U32 *dither) {
+  for (auto i = std::size_t{0}; i < count; i++) {
+    const auto x = std::clamp(in[i], static_cast<T>(-1), static_cast<T>(1));
+    if constexpr (std::is_same_v<T, fixed_t>) {
+      // stays in integers, the noise is two 16 bit uniforms in Q16 LSBs
+      auto scaled = S64{x.raw} * 32767;
+      if (dither != nullptr) {
+        next_uniform(*dither);
+        scaled += S64{static_cast<S32>(*dither >> 16) - 32768};
+        next_uniform(*dither);
+        scaled += S64{static_cast<S32>(*dither >> 16) - 32768};
+      }
+      const auto rounded = (scaled + (fixed_t::ONE / 2)) >> 16;
+      out[i] = static_cast<S16>(std::clamp<S64>(rounded, -32768, 32767));
+    } else {
+      auto noise = 0.0f;
+      if (dither != nullptr) {
+        // TPDF: the sum of two uniform values spans +/- 1 LSB
+        noise = next_uniform(*dither) + next_uniform(*dither);
+      }
+      const auto y = static_cast<F32>(x) * 32767.0f + noise;
+      out[i] =
+          static_cast<S16>(std::clamp(std::round(y), -32768.0f, 32767.0f));
+    }
+  }
+}
+
+template <channel_layout L, typename S, typename T>
+constexpr std::array<run_fn<S, T>, 4> runs() {
+  return {run<L, interpolation::none, S, T>,
+          run<L, interpolation::linear, S, T>,
+          run<L, interpolation::cubic, S, T>,
+          run<L, interpolation::sinc, S, T>};
+}
+
+template <typename T>
+constexpr table<T> variant{
+    .isa = AXOLOTLSD_KERNEL_ISA,
+    .run_u8 = {runs<channel_layout::mono, U8, T>(),
+               runs<channel_layout::stereo, U8, T>()},
+    .run_f32 = {runs<channel_layout::mono, F32, T>(),
+                runs<channel_layout::stereo, F32, T>()},
+    .mix_sfx = {mix_sfx<channel_layout::mono, T>,
+                mix_sfx<channel_layout::stereo, T>},
+    .echo = {echo<channel_layout::mono, T>, echo<channel_layout::stereo, T>},
+    .scale = scale<T>,
+    .clamp = clamp<T>,
+    .to_f32 = to_f32<T>,
+    .to_s16 = to_s16<T>};
+} // namespace AXOLOTLSD_KERNEL_NAME
@@ -0,0 +1,433 @@
+// ============================================================================
+//   Copyright 2023 Roland Metivier <metivier.roland@chlorophyt.us>
+//
+//   Licensed under the Apache License, Version 2.0 (the "License");
+//   you may not use this file except in compliance with the License.
+//   You may obtain a copy of the License at
+//
+//       http://www.apache.org/licenses/LICENSE-2.0
+//
+//   Unless required by applicable law or agreed to in writing, software
+//   distributed under the License is distributed on an "AS IS" BASIS,
+//   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+//   See the License for the specific language governing permissions and
+//   limitations under the License.
+// ============================================================================
+//   AxolotlSD for C++ packed song libraries
+//
+//   A library is a header, the entries (each on a 64 byte boundary), then a
+//   table of contents, a name hash table and the names:
+//
+//     header | entries... | toc | slots | names
+//
+//   Slots hold a TOC index + 1 (0 is empty) and are probed linearly from the
+//   name's hash, there are at least twice as many slots as entries.
+#include "axolotlsd_writer.hpp"
+#include <algorithm>
+#include <fstream>
+#include <iterator>
+#include <limits>
+#include <unordered_set>
+#if __has_include(<sys/mman.h>)
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#define AXOLOTLSD_MMAP 1
+#endif
+
+using namespace axolotlsd;
+
+constexpr static U32 LIBRARY_MAGIC = 0x4158534C; // "AXSL"
+constexpr static U16 LIBRARY_VERSION = 0x0001;
+constexpr static U64 ENTRY_ALIGNMENT = 64;
+constexpr static auto TRUNCATED = "Song library is truncated";
+
+enum class compression : U8 { none, lz };
+
+struct library_header {
+  U32 magic;
+  U16 library_version;
+  U16 padding = 0;
+  U32 entry_count;
+  U32 slot_count;
+  U64 toc_at = 0;
+  U64 slots_at = 0;
+  U64 names_at = 0;
+  U64 size = 0;
+};
+struct toc_entry {
+  U64 name_hash;
+  U64 data_at;
+  U64 stored_size;
+  U64 size;
+  // source_hash() of the uncompressed bytes
+  U64 data_hash;
+  U32 name_at;
+  U16 name_size;
+  entry_kind kind;
+  compression packing;
+};
+static_assert(sizeof(library_header) == 48);
+static_assert(sizeof(toc_entry) == 48);
+
+static U64 name_hash(std::string_view name) {
+  return source_hash(std::span<const U8>{
+      reinterpret_cast<const U8 *>(name.data()), name.size()});
+}
+
+static entry_kind kind_of(std::span<const U8> bytes) {
+  if (bytes.size() >= 4) {
+    const auto magic = (U32{bytes[0]} << 24) | (U32{bytes[1]} << 16) |
+                       (U32{bytes[2]} << 8) | U32{bytes[3]};
+    if (magic == 0x41585344) {
+      return entry_kind::song;
+    }
+    // compiled images store "AXSC" little endian
+    if (magic == 0x43535841) {
+      return entry_kind::compiled;
+    }
+  }
+  return entry_kind::sfx;
+}
+
+// Byte oriented LZ77: a control byte under 0x80 starts a run of that many
+// + 1 literals, otherwise it is a match of (control & 0x7F) + 4 bytes found
+// a little endian U16 distance back
+constexpr static U32 MIN_MATCH = 4;
+constexpr static U32 MAX_MATCH = 0x7F + MIN_MATCH;
+constexpr static U32 MAX_LITERALS = 0x80;
+// a match is 3 stored bytes for at most MAX_MATCH out, nothing expands more
+constexpr static U32 MATCH_BYTES = 3;
+
+static std::vector<U8> lz_compress(std::span<const U8> in) {
+  auto out = std::vector<U8>{};
+  auto w = writer{out};
+  auto recent = std::vector<U32>(4096, 0);
+  auto literals = std::size_t{0};
+  auto flush = [&](std::size_t until) {
+    while (literals < until) {
+      const auto count =
+          std::min<std::size_t>(until - literals, MAX_LITERALS);
+      w.u8(static_cast<U8>(count - 1));
+      out.insert(out.end(), in.begin() + literals,
+                 in.begin() + literals + count);
+      literals += count;
+    }
+  };
+
+  auto at = std::size_t{0};
+  while (at + MIN_MATCH <= in.size()) {
+    auto key = U32{0};
+    std::memcpy(&key, in.data() + at, sizeof(key));
+    auto &&slot = recent[(key * 2654435761u) >> 20];
+    const auto candidate = static_cast<std::size_t>(slot);
+    slot = static_cast<U32>(at + 1);
+    if ((candidate > 0) && (at + 1 - candidate <= 0xFFFF) &&
+        (std::memcmp(in.data() + candidate - 1, in.data() + at, MIN_MATCH) ==
+         0)) {
+      const auto from = candidate - 1;
+      auto length = MIN_MATCH;
+      while ((at + length < in.size()) && (length < MAX_MATCH) &&
+             (in[from + length] == in[at + length])) {
+        length++;
+      }
+      flush(at);
+      w.u8(static_cast<U8>(0x80 | (length - MIN_MATCH)));
+      w.u16(static_cast<U16>(at - from));
+      at += length;
+      literals = at;
+    } else {
+      at++;
+    }
+  }
+  flush(in.size());
+  return out;
+}
+
+static std::vector<U8> lz_decompress(std::span<const U8> in, U64 size) {
+  // a size the stored bytes could never expand to is never reserved
+  if (size / MAX_MATCH > in.size() / MATCH_BYTES) {
+    fail<std::runtime_error>("Song library entry is corrupt");
+  }
+  auto out = std::vector<U8>{};
+  out.reserve(size);
+  auto at = std::size_t{0};
+  while (at < in.size()) {
+    const auto control = in[at++];
+    if (control < 0x80) {
+      const auto count = std::size_t{control} + 1;
+      if ((in.size() - at < count) || (size - out.size() < count)) {
+        fail<std::runtime_error>("Song library entry is corrupt");
+      }
+      out.insert(out.end(), in.begin() + at, in.begin() + at + count);
+      at += count;
+    } else {
+      const auto length = std::size_t{control & 0x7Fu} + MIN_MATCH;
+      if (in.size() - at < 2) {
+        fail<std::runtime_error>("Song library entry is corrupt");
+      }
+      const auto distance =
+          std::size_t{in[at]} | (std::size_t{in[at + 1]} << 8);
+      at += 2;
+      if ((distance == 0) || (distance > out.size()) ||
+          (size - out.size() < length)) {
+        fail<std::runtime_error>("Song library entry is corrupt");
+      }
+      // byte by byte, a match may overlap what it is copying
+      for (auto i = std::size_t{0}; i < length; i++) {
+        out.emplace_back(out[out.size() - distance]);
+      }
+    }
+  }
+  if (out.size() != size) {
+    fail<std::runtime_error>("Song library entry is corrupt");
+  }
+  return out;
+}
+
+std::vector<U8> library::pack(std::span<const library_input> inputs) {
+  if constexpr (std::endian::native != std::endian::little) {
+    fail<std::runtime_error>("Song libraries need little endian");
+  }
+  auto bytes = std::vector<U8>(sizeof(library_header));
+  auto toc = std::vector<toc_entry>{};
+  auto names = std::vector<U8>{};
+
+  // find() only ever reaches the first of two entries with one name
+  auto seen = std::unordered_set<std::string_view>{};
+  for (auto &&input : inputs) {
+    if (input.name.size() > std::numeric_limits<U16>::max()) {
+      fail<std::runtime_error>("Song library entry name is too long: " +
+                               input.name.substr(0, 32) + "...");
+    }
+    if (!seen.insert(input.name).second) {
+      fail<std::runtime_error>("Song library has two entries named " +
+                               input.name);
+    }
+  }
+
+  for (auto &&input : inputs) {
+    auto stored = std::vector<U8>{};
+    auto packing = compression::none;
+    if (input.compress) {
+      stored = lz_compress(input.bytes);
+      packing = compression::lz;
+    }
+    // compression that does not pay is dropped
+    if ((packing == compression::none) ||
+        (stored.size() >= input.bytes.size())) {
+      stored = input.bytes;
+      packing = compression::none;
+    }
+
+    bytes.resize((bytes.size() + ENTRY_ALIGNMENT - 1) &
+                 ~(ENTRY_ALIGNMENT - 1));
+    toc.emplace_back(
+        toc_entry{.name_hash = name_hash(input.name),
+                  .data_at = bytes.size(),
+                  .stored_size = stored.size(),
+                  .size = input.bytes.size(),
+                  .data_hash = source_hash(input.bytes),
+                  .name_at = static_cast<U32>(names.size()),
+                  .name_size = static_cast<U16>(input.name.size()),
+                  .kind = kind_of(input.bytes),
+                  .packing = packing});
+    bytes.insert(bytes.end(), stored.begin(), stored.end());
+    names.insert(names.end(), input.name.begin(), input.name.end());
+  }
+
+  auto slots = std::vector<U32>(std::bit_ceil(std::max<std::size_t>(
+                                    toc.size() * 2, 1)),
+                                0);
+  for (auto i = U32{0}; i < toc.size(); i++) {
+    auto s = toc[i].name_hash & (slots.size() - 1);
+    while (slots[s] != 0) {
+      s = (s + 1) & (slots.size() - 1);
+    }
+    slots[s] = i + 1;
+  }
+
+  auto header = library_header{.magic = LIBRARY_MAGIC,
+                               .library_version = LIBRARY_VERSION,
+                               .entry_count = static_cast<U32>(toc.size()),
+                               .slot_count = static_cast<U32>(slots.size())};
+  bytes.resize((bytes.size() + alignof(U64) - 1) & ~(alignof(U64) - 1));
+  header.toc_at = bytes.size();
+  for (auto &&t : toc) {
+    put_record(bytes, t);
+  }
+  header.slots_at = bytes.size();
+  for (auto &&s : slots) {
+    put_record(bytes, s);
+  }
+  header.names_at = bytes.size();
+  bytes.insert(bytes.end(), names.begin(), names.end());
+  header.size = bytes.size();
+  std::memcpy(bytes.data(), &header, sizeof(library_header));
+  return bytes;
+}
+
+library library::view(std::span<const U8> archive) {
+  if constexpr (std::endian::native != std::endian::little) {
+    fail<std::runtime_error>("Song libraries need little endian");
+  }
+  const auto header = get_record<library_header>(archive, 0, TRUNCATED);
+  if (header.magic != LIBRARY_MAGIC) {
+    fail<std::runtime_error>("First 4 bytes of this library are not 'AXSL'!");
+  }
+  if (header.library_version != LIBRARY_VERSION) {
+    fail<std::runtime_error>("Version mismatch in song library");
+  }
+  if ((header.size != archive.size()) ||
+      (!std::has_single_bit(header.slot_count)) ||
+      (header.toc_at + (U64{header.entry_count} * sizeof(toc_entry)) >
+       archive.size()) ||
+      (header.slots_at + (U64{header.slot_count} * sizeof(U32)) >
+       archive.size()) ||
+      (header.names_at > archive.size())) {
+    fail<std::runtime_error>(TRUNCATED);
+  }
+  return library{
+      .archive = archive,
+      .checked = std::make_shared<std::vector<std::atomic<bool>>>(
+          header.entry_count)};
+}
+
+library library::open(const std::string &path) {
+#ifdef AXOLOTLSD_MMAP
+  const auto fd = ::open(path.c_str(), O_RDONLY);
+  if (fd >= 0) {
+    struct stat st {};
+    if ((::fstat(fd, &st) == 0) && (st.st_size > 0)) {
+      const auto size = static_cast<std::size_t>(st.st_size);
+      auto mapped = ::mmap(nullptr, size, PROT_READ, MAP_PRIVATE, fd, 0);
+      ::close(fd);
+      if (mapped != MAP_FAILED) {
+        auto storage = std::shared_ptr<const void>{
+            mapped, [size](const void *m) {
+              ::munmap(const_cast<void *>(m), size);
+            }};
+        auto lib = view({static_cast<const U8 *>(mapped), size});
+        lib.storage = std::move(storage);
+        return lib;
+      }
+    } else {
+      ::close(fd);
+    }
+  }
+#endif
+  // no mapping to be had, read it in instead
+  auto in = std::ifstream{path, std::ios::binary};
+  if (!in) {
+    fail<std::runtime_error>("Could not open song library " + path);
+  }
+  auto bytes = std::make_shared<const std::vector<U8>>(
+      std::istreambuf_iterator<char>{in}, std::istreambuf_iterator<char>{});
+  auto lib = view(*bytes);
+  lib.storage = std::move(bytes);
+  return lib;
+}
+
+static toc_entry toc_at(std::span<const U8> archive, U32 which) {
+  const auto header = get_record<library_header>(archive, 0, TRUNCATED);
+  if (which >= header.entry_count) {
+    fail<std::out_of_range>("No such entry in song library");
+  }
+  return get_record<toc_entry>(
+      archive, header.toc_at + (std::size_t{which} * sizeof(toc_entry)),
+      TRUNCATED);
+}
+
+U32 library::size() const {
+  return get_record<library_header>(archive, 0, TRUNCATED).entry_count;
+}
+
+std::optional<U32> library::find(std::string_view name) const {
+  const auto header = get_record<library_header>(archive, 0, TRUNCATED);
+  const auto hash = name_hash(name);
+  const auto mask = header.slot_count - 1;
+  for (auto s = hash & mask, probes = U64{0}; probes < header.slot_count;
+       s = (s + 1) & mask, probes++) {
+    const auto slot = get_record<U32>(
+        archive, header.slots_at + (s * sizeof(U32)), TRUNCATED);
+    if (slot == 0) {
+      return std::nullopt;
+    }
+    const auto t = toc_at(archive, slot - 1);
+    if ((t.name_hash == hash) && (info(slot - 1).name == name)) {
+      return slot - 1;
+    }
+  }
+  return std::nullopt;
+}
+
+library::entry library::info(U32 which) const {
+  const auto header = get_record<library_header>(archive, 0, TRUNCATED);
+  const auto t = toc_at(archive, which);
+  if (header.names_at + t.name_at + t.name_size > archive.size()) {
+    fail<std::runtime_error>(TRUNCATED);
+  }
+  return entry{
+      .name = {reinterpret_cast<const char *>(archive.data()) +
+                   header.names_at + t.name_at,
+               t.name_size},
+      .kind = t.kind,
+      .compressed = t.packing != compression::none,
+      .size = t.size};
+}
+
+// The entry as stored, still compressed if it was packed that way
+static std::span<const U8> stored(std::span<const U8> archive,
+                                  const toc_entry &t) {
+  if ((t.data_at > archive.size()) ||
+      (archive.size() - t.data_at < t.stored_size)) {
+    fail<std::runtime_error>(TRUNCATED);
+  }
+  return archive.subspan(t.data_at, t.stored_size);
+}
+
+std::vector<U8> library::read(U32 which) const {
+  const auto t = toc_at(archive, which);
+  const auto data = stored(archive, t);
+  auto bytes = (t.packing == compression::lz)
+                   ? lz_decompress(data, t.size)
+                   : std::vector<U8>(data.begin(), data.end());
+  if (source_hash(bytes) != t.data_hash) {
+    fail<std::runtime_error>("Song library entry fails its hash");
+  }
+  return bytes;
+}
+
+song library::load_song(U32 which, const load_options &options) const {
+  const auto t = toc_at(archive, which);
+  switch (t.kind) {
+  case entry_kind::compiled: {
+    // uncompressed images load straight out of the archive, they carry
+    // their own checksum
+    if (t.packing == compression::none) {
+      auto done = checked ? &(*checked)[which] : nullptr;
+      auto the_song = song::load_compiled(
+          stored(archive, t),
+          {.storage = storage,
+           .checked = done && done->load(std::memory_order_acquire)});
+      if (done) {
+        done->store(true, std::memory_order_release);
+      }
+      return the_song;
+    }
+    // read() already checked the bytes against their hash
+    auto bytes = std::make_shared<const std::vector<U8>>(read(which));
+    return song::load_compiled(*bytes, {.storage = bytes, .checked = true});
+  }
+  case entry_kind::song: {
+    auto bytes = read(which);
+    return song::load(bytes, options);
+  }
+  default: {
+    fail<std::runtime_error>("Song library entry is not a song");
+  }
+  }
+}
+
+sfx library::load_sfx(U32 which) const { return sfx{.data = read(which)}; }
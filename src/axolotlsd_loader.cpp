@@ -0,0 +1,87 @@
+// ============================================================================
+//   Copyright 2023 Roland Metivier <metivier.roland@chlorophyt.us>
+//
+//   Licensed under the Apache License, Version 2.0 (the "License");
+//   you may not use this file except in compliance with the License.
+//   You may obtain a copy of the License at
+//
+//       http://www.apache.org/licenses/LICENSE-2.0
+//
+//   Unless required by applicable law or agreed to in writing, software
+//   distributed under the License is distributed on an "AS IS" BASIS,
+//   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+//   See the License for the specific language governing permissions and
+//   limitations under the License.
+// ============================================================================
+//   AxolotlSD for C++ background song loading
+#include "../include/axolotlsd.hpp"
+#include <algorithm>
+
+using namespace axolotlsd;
+
+static song_loader::result_t cancelled_error() {
+  return {load_error{.kind = load_error_kind::cancelled, .offset = 0}};
+}
+
+song_loader::song_loader(U32 count) {
+  count = std::max(count, U32{1});
+  for (auto i = 0; i < count; i++) {
+    workers.emplace_back(&song_loader::work, this);
+  }
+}
+
+song_loader::~song_loader() {
+  {
+    auto held = std::unique_lock{lock};
+    stopping = true;
+  }
+  wake.notify_all();
+  std::for_each(workers.begin(), workers.end(), [](auto &&w) { w.join(); });
+
+  // whatever never started is cancelled rather than left broken
+  for (auto &&next : queue) {
+    next->promise.set_value(cancelled_error());
+  }
+}
+
+song_loader::ticket song_loader::load(std::vector<U8> bytes,
+                                      const load_options &options) {
+  auto next = std::make_shared<request>();
+  next->bytes = std::move(bytes);
+  next->options = options;
+  auto result = next->promise.get_future();
+  {
+    auto held = std::unique_lock{lock};
+    queue.emplace_back(next);
+  }
+  wake.notify_one();
+  return ticket{.held = std::move(next), .result = std::move(result)};
+}
+
+void song_loader::work() {
+  auto held = std::unique_lock{lock};
+  while (true) {
+    wake.wait(held, [this] { return stopping || !queue.empty(); });
+    if (stopping) {
+      return;
+    }
+    auto next = std::move(queue.front());
+    queue.pop_front();
+    held.unlock();
+
+    if (next->cancelled) {
+      next->promise.set_value(cancelled_error());
+    } else if (auto loaded = song::try_load(next->bytes, next->options);
+               !loaded) {
+      next->promise.set_value({loaded.error()});
+    } else if (next->cancelled) {
+      next->promise.set_value(cancelled_error());
+    } else {
+      next->promise.set_value(
+          {std::make_shared<const song>(std::move(*loaded))});
+    }
+    // the source is no longer needed once parsed
+    next->bytes = {};
+    held.lock();
+  }
+}
@@ -0,0 +1,73 @@
+// ============================================================================
+//   Copyright 2023 Roland Metivier <metivier.roland@chlorophyt.us>
+//
+//   Licensed under the Apache License, Version 2.0 (the "License");
+//   you may not use this file except in compliance with the License.
+//   You may obtain a copy of the License at
+//
+//       http://www.apache.org/licenses/LICENSE-2.0
+//
+//   Unless required by applicable law or agreed to in writing, software
+//   distributed under the License is distributed on an "AS IS" BASIS,
+//   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+//   See the License for the specific language governing permissions and
+//   limitations under the License.
+// ============================================================================
+//   AxolotlSD for C++ interned waveform store
+#include "../include/axolotlsd.hpp"
+#include <algorithm>
+
+using namespace axolotlsd;
+
+waveform_store &waveform_store::global() {
+  // never destroyed, songs may outlive static destruction order
+  static auto *store = new waveform_store;
+  return *store;
+}
+
+waveform_t waveform_store::intern(std::span<const U8> bytes) {
+  const auto hash = source_hash(bytes);
+  auto held = std::unique_lock{lock};
+  auto [it, end] = entries.equal_range(hash);
+  while (it != end) {
+    auto live = it->second.lock();
+    if (!live) {
+      it = entries.erase(it);
+      continue;
+    }
+    if (std::equal(live->begin(), live->end(), bytes.begin(), bytes.end())) {
+      hits++;
+      return {*live, live};
+    }
+    it++;
+  }
+  auto made = std::make_shared<const patch_data_t>(bytes.begin(), bytes.end());
+  entries.emplace(hash, made);
+  return {*made, made};
+}
+
+waveform_store::stats_t waveform_store::stats() {
+  auto held = std::unique_lock{lock};
+  auto result = stats_t{.waveforms = 0, .bytes = 0, .hits = hits,
+                        .bytes_saved = 0};
+  for (auto &&[hash, entry] : entries) {
+    auto live = entry.lock();
+    if (!live) {
+      continue;
+    }
+    // less the reference taken just above
+    const auto holders = static_cast<U64>(live.use_count() - 1);
+    result.waveforms++;
+    result.bytes += live->size();
+    if (holders > 1) {
+      result.bytes_saved += (holders - 1) * live->size();
+    }
+  }
+  return result;
+}
+
+std::size_t waveform_store::purge() {
+  auto held = std::unique_lock{lock};
+  return std::erase_if(entries,
+                       [](auto &&entry) { return entry.second.expired(); });
+}
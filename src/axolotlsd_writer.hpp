@@ -0,0 +1,75 @@
+// ============================================================================
+//   Copyright 2023 Roland Metivier <metivier.roland@chlorophyt.us>
+//
+//   Licensed under the Apache License, Version 2.0 (the "License");
+//   you may not use this file except in compliance with the License.
+//   You may obtain a copy of the License at
+//
+//       http://www.apache.org/licenses/LICENSE-2.0
+//
+//   Unless required by applicable law or agreed to in writing, software
+//   distributed under the License is distributed on an "AS IS" BASIS,
+//   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+//   See the License for the specific language governing permissions and
+//   limitations under the License.
+// ============================================================================
+//   AxolotlSD for C++ byte stream helpers for AXSD and the binary formats
+#pragma once
+#include "../include/axolotlsd.hpp"
+#include <bit>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <stdexcept>
+#include <string>
+
+namespace axolotlsd {
+// Throws E, or with exceptions turned off prints what and aborts
+template <typename E> [[noreturn]] void fail(const std::string &what) {
+#if defined(__cpp_exceptions)
+  throw E{what};
+#else
+  std::fputs(what.c_str(), stderr);
+  std::fputc('\n', stderr);
+  std::abort();
+#endif
+}
+
+// Appends little endian AXSD fields
+struct writer {
+  std::vector<U8> &bytes;
+
+  void u8(U8 x) { bytes.emplace_back(x); }
+  void u16(U16 x) {
+    u8(x & 0xFF);
+    u8(x >> 8);
+  }
+  void u32(U32 x) {
+    u16(x & 0xFFFF);
+    u16(x >> 16);
+  }
+  void f32(F32 x) { u32(std::bit_cast<U32>(x)); }
+  void timed(command_type type, song_tick_t tick, U8 channel) {
+    u8(static_cast<U8>(type));
+    u32(tick);
+    u8(channel);
+  }
+};
+
+// Fixed layout records are written and read as they sit in memory, so the
+// formats made of them are little endian hosts only
+template <typename R> void put_record(std::vector<U8> &bytes, const R &r) {
+  const auto at = bytes.size();
+  bytes.resize(at + sizeof(R));
+  std::memcpy(bytes.data() + at, &r, sizeof(R));
+}
+template <typename R>
+R get_record(std::span<const U8> bytes, std::size_t at, const char *what) {
+  if ((at > bytes.size()) || (bytes.size() - at < sizeof(R))) {
+    fail<std::runtime_error>(what);
+  }
+  auto r = R{};
+  std::memcpy(&r, bytes.data() + at, sizeof(R));
+  return r;
+}
+} // namespace axolotlsd
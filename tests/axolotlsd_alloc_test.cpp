@@ -0,0 +1,201 @@
+// ============================================================================
+//   Copyright 2023 Roland Metivier <metivier.roland@chlorophyt.us>
+//
+//   Licensed under the Apache License, Version 2.0 (the "License");
+//   you may not use this file except in compliance with the License.
+//   You may obtain a copy of the License at
+//
+//       http://www.apache.org/licenses/LICENSE-2.0
+//
+//   Unless required by applicable law or agreed to in writing, software
+//   distributed under the License is distributed on an "AS IS" BASIS,
+//   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+//   See the License for the specific language governing permissions and
+//   limitations under the License.
+// ============================================================================
+//   AxolotlSD for C++ allocation test, fails if tick() touches the heap
+//   after play()
+#include "../include/axolotlsd.hpp"
+#include <algorithm>
+#include <cstdio>
+#include <cstdlib>
+#include <new>
+#include <string>
+
+using namespace axolotlsd;
+
+// Only the rendering thread counts, the prefetcher and loaders may allocate
+static thread_local bool counting = false;
+static thread_local U64 heap_calls = 0;
+
+static void *allocate(std::size_t size, std::size_t align) {
+  if (counting) {
+    heap_calls++;
+  }
+  size = std::max<std::size_t>(size, 1);
+  auto p = (align > alignof(std::max_align_t))
+               ? std::aligned_alloc(align, ((size + align - 1) / align) * align)
+               : std::malloc(size);
+  if (p == nullptr) {
+    throw std::bad_alloc{};
+  }
+  return p;
+}
+
+static void release(void *p) {
+  if (counting && (p != nullptr)) {
+    heap_calls++;
+  }
+  std::free(p);
+}
+
+void *operator new(std::size_t size) { return allocate(size, 0); }
+void *operator new[](std::size_t size) { return allocate(size, 0); }
+void *operator new(std::size_t size, std::align_val_t align) {
+  return allocate(size, static_cast<std::size_t>(align));
+}
+void *operator new[](std::size_t size, std::align_val_t align) {
+  return allocate(size, static_cast<std::size_t>(align));
+}
+void operator delete(void *p) noexcept { release(p); }
+void operator delete[](void *p) noexcept { release(p); }
+void operator delete(void *p, std::size_t) noexcept { release(p); }
+void operator delete[](void *p, std::size_t) noexcept { release(p); }
+void operator delete(void *p, std::align_val_t) noexcept { release(p); }
+void operator delete[](void *p, std::align_val_t) noexcept { release(p); }
+void operator delete(void *p, std::size_t, std::align_val_t) noexcept {
+  release(p);
+}
+void operator delete[](void *p, std::size_t, std::align_val_t) noexcept {
+  release(p);
+}
+
+constexpr static U32 RATE = 44100;
+constexpr static U32 FRAMES_PER_CALL = 1024;
+// a few times round the song, so the loop point is crossed too
+constexpr static U32 CALLS = 256;
+
+static auto failures = 0;
+
+// More notes per step than most players have voices, with the pitchwheel
+// moving and drums on every step
+static std::vector<U8> dense_song() {
+  return generate_song({.channels = 8,
+                        .voices = 24,
+                        .steps = 64,
+                        .step_ticks = 2,
+                        .pitchwheel = 2,
+                        .drums = 4,
+                        .patch_size = 2048,
+                        .ticks_per_second = 240});
+}
+
+template <typename F> static void expect_no_heap(const std::string &name,
+                                                 F &&render) {
+  heap_calls = 0;
+  counting = true;
+  for (auto i = U32{0}; i < CALLS; i++) {
+    render(i);
+  }
+  counting = false;
+  if (heap_calls > 0) {
+    std::printf("FAIL %s: %llu heap calls\n", name.c_str(),
+                static_cast<unsigned long long>(heap_calls));
+    failures++;
+  } else {
+    std::printf("ok   %s\n", name.c_str());
+  }
+}
+
+template <typename T>
+static void check_player(const std::string &name,
+                         std::shared_ptr<const song> s, U32 voices,
+                         interpolation quality, U32 prefetch_ticks = 0) {
+  auto p = std::make_unique<basic_player<T>>(voices, RATE, true);
+  p->quality = quality;
+  p->prefetch_ticks = prefetch_ticks;
+  p->put_environment(environment{.feedback_L = 0.5f,
+                                 .feedback_R = 0.5f,
+                                 .wet_L = 0.3f,
+                                 .wet_R = 0.3f,
+                                 .cursor_max = 8000});
+  p->load(std::move(s));
+  p->play();
+  auto samples = std::vector<U8>(RATE / 4, 0x80);
+  p->queue_sfx(sfx{.pitch = 1.5f, .data = samples});
+
+  auto out = std::vector<F32>(FRAMES_PER_CALL * 2);
+  expect_no_heap(name, [&p, &out](U32) { p->tick(out); });
+}
+
+int main() {
+  auto bytes = dense_song();
+  const auto eager =
+      std::make_shared<const song>(song::load(bytes, {.mip_levels = 3}));
+  const auto qualities = {std::pair{interpolation::none, "none"},
+                          std::pair{interpolation::linear, "linear"},
+                          std::pair{interpolation::cubic, "cubic"},
+                          std::pair{interpolation::sinc, "sinc"}};
+  for (auto &&[quality, label] : qualities) {
+    for (auto voices : {U32{8}, U32{64}}) {
+      const auto suffix =
+          std::string{"/voices="} + std::to_string(voices) + "/" + label;
+      check_player<F32>("F32" + suffix, eager, voices, quality);
+      check_player<F64>("F64" + suffix, eager, voices, quality);
+      check_player<fixed_t>("fixed" + suffix, eager, voices, quality);
+    }
+  }
+
+  // mip levels are left to the prefetcher, never built while rendering
+  for (auto prefetch : {U32{0}, U32{16}}) {
+    const auto lazy = std::make_shared<const song>(
+        song::load(bytes, {.mip_levels = 3, .lazy = true}));
+    check_player<F32>("lazy/prefetch=" + std::to_string(prefetch), lazy, 32,
+                      interpolation::cubic, prefetch);
+  }
+
+  // channel 0 never gets a program and the first drum has no sample, so
+  // their voices are retired mid-run. More notes than voices arrive on
+  // every tick, every ten frames, before the pool is next compacted.
+  {
+    auto fast = generate_song({.channels = 8,
+                               .voices = 24,
+                               .steps = 64,
+                               .step_ticks = 1,
+                               .drums = 4,
+                               .patch_size = 2048,
+                               .ticks_per_second = 4410});
+    auto broken = song::load(fast, {.mip_levels = 3});
+    std::erase_if(broken.commands, [](auto &&held) {
+      auto &&program = std::get_if<command_program_change>(&held.second);
+      return (program != nullptr) && (program->channel == 0);
+    });
+    broken.drums.erase(broken.drums.begin());
+    const auto unpatched = std::make_shared<const song>(std::move(broken));
+    for (auto voices : {U32{2}, U32{8}}) {
+      check_player<F32>("unpatched/voices=" + std::to_string(voices),
+                        unpatched, voices, interpolation::linear);
+    }
+  }
+
+  // a song queued from outside is swapped in at a block boundary, and the
+  // one it replaces is released by the next queue_song(), not in tick()
+  {
+    auto p = std::make_unique<player>(32, RATE, true);
+    p->load(eager);
+    p->play();
+    auto other = std::make_shared<const song>(song::load(
+        bytes, {.mip_levels = 3, .lazy = true}));
+    auto out = std::vector<F32>(FRAMES_PER_CALL * 2);
+    expect_no_heap("handover", [&](U32 i) {
+      if ((i % 16) == 0) {
+        counting = false;
+        p->queue_song((i % 32) == 0 ? other : eager);
+        counting = true;
+      }
+      p->tick(out);
+    });
+  }
+
+  return (failures == 0) ? EXIT_SUCCESS : EXIT_FAILURE;
+}
@@ -0,0 +1,66 @@
+// ============================================================================
+//   Copyright 2023 Roland Metivier <metivier.roland@chlorophyt.us>
+//
+//   Licensed under the Apache License, Version 2.0 (the "License");
+//   you may not use this file except in compliance with the License.
+//   You may obtain a copy of the License at
+//
+//       http://www.apache.org/licenses/LICENSE-2.0
+//
+//   Unless required by applicable law or agreed to in writing, software
+//   distributed under the License is distributed on an "AS IS" BASIS,
+//   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+//   See the License for the specific language governing permissions and
+//   limitations under the License.
+// ============================================================================
+//   AxolotlSD for C++ AXSD to precompiled image converter
+//
+//   Usage: axolotlsd_compile <input AXSD> <output image> [mip levels]
+#include "../include/axolotlsd.hpp"
+#include <cstdio>
+#include <cstdlib>
+#include <exception>
+#include <fstream>
+#include <iterator>
+
+using namespace axolotlsd;
+
+int main(int argc, char **argv) {
+  if (argc < 3) {
+    std::fprintf(stderr,
+                 "usage: %s <input AXSD> <output image> [mip levels]\n",
+                 argv[0]);
+    return EXIT_FAILURE;
+  }
+  auto options = load_options{};
+  if (argc > 3) {
+    options.mip_levels = static_cast<U8>(std::strtoul(argv[3], nullptr, 0));
+  }
+
+  try {
+    auto in = std::ifstream{argv[1], std::ios::binary};
+    if (!in) {
+      std::fprintf(stderr, "could not read '%s'\n", argv[1]);
+      return EXIT_FAILURE;
+    }
+    auto source = std::vector<U8>{std::istreambuf_iterator<char>{in},
+                                  std::istreambuf_iterator<char>{}};
+    const auto hash = source_hash(source);
+    const auto image = song::load(source, options).compile(hash);
+
+    // an image that does not load back is never written
+    song::load_compiled(image, hash);
+
+    auto out = std::ofstream{argv[2], std::ios::binary};
+    out.write(reinterpret_cast<const char *>(image.data()),
+              static_cast<std::streamsize>(image.size()));
+    if (!out) {
+      std::fprintf(stderr, "could not write '%s'\n", argv[2]);
+      return EXIT_FAILURE;
+    }
+  } catch (const std::exception &e) {
+    std::fprintf(stderr, "%s: %s\n", argv[1], e.what());
+    return EXIT_FAILURE;
+  }
+  return EXIT_SUCCESS;
+}
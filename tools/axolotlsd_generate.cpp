@@ -0,0 +1,85 @@
+// ============================================================================
+//   Copyright 2023 Roland Metivier <metivier.roland@chlorophyt.us>
+//
+//   Licensed under the Apache License, Version 2.0 (the "License");
+//   you may not use this file except in compliance with the License.
+//   You may obtain a copy of the License at
+//
+//       http://www.apache.org/licenses/LICENSE-2.0
+//
+//   Unless required by applicable law or agreed to in writing, software
+//   distributed under the License is distributed on an "AS IS" BASIS,
+//   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+//   See the License for the specific language governing permissions and
+//   limitations under the License.
+// ============================================================================
+//   AxolotlSD for C++ synthetic song generator command line
+//
+//   Usage: axolotlsd_generate <output> [knob=value ...]
+//   Knobs: seed channels voices steps step_ticks pitchwheel drums patch_size
+//          looping rate
+#include "../include/axolotlsd.hpp"
+#include <cstdio>
+#include <cstdlib>
+#include <fstream>
+#include <string_view>
+
+using namespace axolotlsd;
+
+static bool set_knob(generator_options &options, std::string_view arg) {
+  const auto split = arg.find('=');
+  if (split == std::string_view::npos) {
+    return false;
+  }
+  const auto key = arg.substr(0, split);
+  const auto value = static_cast<U32>(
+      std::strtoul(arg.substr(split + 1).data(), nullptr, 0));
+  if (key == "seed") {
+    options.seed = value;
+  } else if (key == "channels") {
+    options.channels = static_cast<U8>(value);
+  } else if (key == "voices") {
+    options.voices = value;
+  } else if (key == "steps") {
+    options.steps = value;
+  } else if (key == "step_ticks") {
+    options.step_ticks = value;
+  } else if (key == "pitchwheel") {
+    options.pitchwheel = value;
+  } else if (key == "drums") {
+    options.drums = static_cast<U8>(value);
+  } else if (key == "patch_size") {
+    options.patch_size = value;
+  } else if (key == "looping") {
+    options.looping = value != 0;
+  } else if (key == "rate") {
+    options.ticks_per_second = value;
+  } else {
+    return false;
+  }
+  return true;
+}
+
+int main(int argc, char **argv) {
+  if (argc < 2) {
+    std::fprintf(stderr, "usage: %s <output> [knob=value ...]\n", argv[0]);
+    return EXIT_FAILURE;
+  }
+  auto options = generator_options{};
+  for (auto i = 2; i < argc; i++) {
+    if (!set_knob(options, argv[i])) {
+      std::fprintf(stderr, "unknown knob '%s'\n", argv[i]);
+      return EXIT_FAILURE;
+    }
+  }
+
+  const auto bytes = generate_song(options);
+  auto out = std::ofstream{argv[1], std::ios::binary};
+  out.write(reinterpret_cast<const char *>(bytes.data()),
+            static_cast<std::streamsize>(bytes.size()));
+  if (!out) {
+    std::fprintf(stderr, "could not write '%s'\n", argv[1]);
+    return EXIT_FAILURE;
+  }
+  return EXIT_SUCCESS;
+}
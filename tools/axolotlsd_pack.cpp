@@ -0,0 +1,96 @@
+// ============================================================================
+//   Copyright 2023 Roland Metivier <metivier.roland@chlorophyt.us>
+//
+//   Licensed under the Apache License, Version 2.0 (the "License");
+//   you may not use this file except in compliance with the License.
+//   You may obtain a copy of the License at
+//
+//       http://www.apache.org/licenses/LICENSE-2.0
+//
+//   Unless required by applicable law or agreed to in writing, software
+//   distributed under the License is distributed on an "AS IS" BASIS,
+//   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+//   See the License for the specific language governing permissions and
+//   limitations under the License.
+// ============================================================================
+//   AxolotlSD for C++ song library packer
+//
+//   Usage: axolotlsd_pack <output library> [-z] <input>...
+//          axolotlsd_pack -l <library>
+//   Entries are named after their input's file name without its extension,
+//   so no two inputs may share one. -z compresses every input after it.
+#include "../include/axolotlsd.hpp"
+#include <cstdio>
+#include <cstdlib>
+#include <exception>
+#include <filesystem>
+#include <fstream>
+#include <iterator>
+
+using namespace axolotlsd;
+
+static int list(const char *path) {
+  const auto lib = library::open(path);
+  for (auto i = U32{0}; i < lib.size(); i++) {
+    const auto e = lib.info(i);
+    const auto kind = (e.kind == entry_kind::song)       ? "song"
+                      : (e.kind == entry_kind::compiled) ? "compiled"
+                                                         : "sfx";
+    std::printf("%u\t%.*s\t%s\t%llu%s\n", i, static_cast<int>(e.name.size()),
+                e.name.data(), kind, static_cast<unsigned long long>(e.size),
+                e.compressed ? "\tcompressed" : "");
+  }
+  return EXIT_SUCCESS;
+}
+
+int main(int argc, char **argv) {
+  if ((argc == 3) && (std::string_view{argv[1]} == "-l")) {
+    try {
+      return list(argv[2]);
+    } catch (const std::exception &e) {
+      std::fprintf(stderr, "%s: %s\n", argv[2], e.what());
+      return EXIT_FAILURE;
+    }
+  }
+  if (argc < 3) {
+    std::fprintf(stderr,
+                 "usage: %s <output library> [-z] <input>...\n"
+                 "       %s -l <library>\n",
+                 argv[0], argv[0]);
+    return EXIT_FAILURE;
+  }
+
+  auto inputs = std::vector<library_input>{};
+  auto compress = false;
+  for (auto i = 2; i < argc; i++) {
+    if (std::string_view{argv[i]} == "-z") {
+      compress = true;
+      continue;
+    }
+    auto in = std::ifstream{argv[i], std::ios::binary};
+    if (!in) {
+      std::fprintf(stderr, "could not read '%s'\n", argv[i]);
+      return EXIT_FAILURE;
+    }
+    inputs.emplace_back(library_input{
+        .name = std::filesystem::path{argv[i]}.stem().string(),
+        .bytes = std::vector<U8>{std::istreambuf_iterator<char>{in},
+                                 std::istreambuf_iterator<char>{}},
+        .compress = compress});
+  }
+
+  try {
+    const auto bytes = library::pack(inputs);
+    auto out = std::ofstream{argv[1], std::ios::binary};
+    out.write(reinterpret_cast<const char *>(bytes.data()),
+              static_cast<std::streamsize>(bytes.size()));
+    if (!out) {
+      std::fprintf(stderr, "could not write '%s'\n", argv[1]);
+      return EXIT_FAILURE;
+    }
+  } catch (const std::exception &e) {
+    std::fprintf(stderr, "%s: %s\n", argv[1], e.what());
+    return EXIT_FAILURE;
+  }
+  return EXIT_SUCCESS;
+}